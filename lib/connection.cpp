@@ -22,10 +22,12 @@
 #include "encryptionmanager.h"
 #include "room.h"
 #include "settings.h"
+#include "timelinestore.h"
 #include "user.h"
 
 #include "csapi/account-data.h"
 #include "csapi/capabilities.h"
+#include "csapi/filter.h"
 #include "csapi/joining.h"
 #include "csapi/leaving.h"
 #include "csapi/login.h"
@@ -43,16 +45,24 @@
 #include "jobs/mediathumbnailjob.h"
 #include "jobs/syncjob.h"
 
-#include <QtCore/QCoreApplication>
+#include <QtConcurrent/QtConcurrentRun>
 #include <QtCore/QDir>
 #include <QtCore/QElapsedTimer>
 #include <QtCore/QFile>
+#include <QtCore/QFutureWatcher>
 #include <QtCore/QMimeDatabase>
+#include <QtCore/QPointer>
 #include <QtCore/QRegularExpression>
+#include <QtCore/QSaveFile>
+#include <QtCore/QSet>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QStringBuilder>
+#include <QtCore/QThreadPool>
+#include <QtCore/QTimer>
 #include <QtNetwork/QDnsLookup>
 
+#include <deque>
+
 using namespace Quotient;
 
 // This is very much Qt-specific; STL iterators don't have key() and value()
@@ -70,6 +80,16 @@ HashT erase_if(HashT& hashMap, Pred pred)
     return removals;
 }
 
+static SyncData::CacheFormat cacheFormatFromSettings()
+{
+    const auto cacheType = SettingsGroup("libQuotient").get(
+        "cache_type",
+        SettingsGroup("libQMatrixClient").get<QString>("cache_type"));
+    return cacheType == "json"      ? SyncData::CacheFormat::Json
+           : cacheType == "records" ? SyncData::CacheFormat::Records
+                                    : SyncData::CacheFormat::QtBinary;
+}
+
 class Connection::Private {
 public:
     explicit Private(std::unique_ptr<ConnectionData>&& connection)
@@ -108,17 +128,72 @@ public:
     QScopedPointer<EncryptionManager> encryptionManager;
 
     SyncJob* syncJob = nullptr;
+    bool backgroundSyncParsing = false;
+    bool incrementalSyncParsing = false;
+    /// Tracks a sync response being parsed on a worker thread, if any
+    QFutureWatcher<void>* syncParsingWatcher = nullptr;
+    bool pipelinedSync = false;
+    /// The filter for /sync, as registered on the server
+    QString syncFilterId;
+    QByteArray syncFilterJson;
+    DefineFilterJob* defineFilterJob = nullptr;
+    bool syncFilterRejected = false;
+    /// Sync batches received but not fully applied yet, oldest first
+    std::deque<SyncData> pendingSyncBatches;
+    bool applyingSyncData = false;
+    /// Rooms of the batch being applied and the order to apply them in
+    SyncDataList roomsToApply;
+    std::vector<size_t> roomApplyOrder;
+    size_t roomsApplied = 0;
+    std::chrono::milliseconds syncSliceBudget { 10 };
+    /// Schedules the next slice of sync data; stopped along with the sync
+    QTimer syncSliceTimer;
 
     bool cacheState = true;
-    bool cacheToBinary =
-        SettingsGroup("libQuotient").get("cache_type",
-                 SettingsGroup("libQMatrixClient").get<QString>("cache_type"))
-        != "json";
+    SyncData::CacheFormat cacheFormat = cacheFormatFromSettings();
     bool lazyLoading = false;
+    bool lazyCacheLoading = false;
+    bool cacheTimeline = false;
+    /// Joined rooms restored from the room index, with the cached state
+    /// not loaded yet
+    QSet<QString> unloadedRoomIds;
+    /// Rooms that failed to load from the cache, with their state being
+    /// fetched from the server
+    QSet<QString> roomIdsToRecover;
+    /// Sync data for the rooms being recovered, held back until the state
+    /// fetched for them is applied; the rooms that have a recovery request
+    /// in flight or scheduled have an entry here
+    UnorderedMap<QString, SyncDataList> heldRoomData;
+    /// Rooms with changes not written to the state cache yet
+    QSet<Room*> dirtyRooms;
+    bool cacheWriteScheduled = false;
+    std::chrono::milliseconds cacheWriteDelay { 1000 };
+    /// Serialises and writes room state cache files; a single thread keeps
+    /// the writes of the same file in order
+    QThreadPool cacheWriterPool;
+    bool timelineInsertion = false;
+    bool gapFilling = false;
+    int maxGapFillJobs = 2;
+    int gapFillJobsRunning = 0;
+    /// Rooms waiting for their turn to fill a gap in the timeline
+    std::deque<QPointer<Room>> gapFillQueue;
 
     void connectWithToken(const QString& userId, const QString& accessToken,
                           const QString& deviceId);
     void removeRoom(const QString& roomId);
+    void parseSyncInBackground(QByteArray&& rawData);
+    void dropSyncInProgress();
+    void consumeSyncData(SyncData&& syncData);
+    void startApplyingSyncBatch();
+    void applySyncSlice();
+    void applyRoomData(SyncRoomData&& roomData, bool fromCache);
+    void loadIndexedRoom(const QString& roomId);
+    void recoverRooms(const QStringList& roomIds, int attempt = 0);
+    /// Apply the sync data held for the rooms while they were recovered
+    void applyHeldRoomData(const QStringList& roomIds);
+    void writeDirtyRooms();
+    void runGapFills();
+    QString syncFilterParam(const Filter& filter);
 
     template <typename EventT>
     EventT* unpackAccountData() const
@@ -154,6 +229,15 @@ Connection::Connection(const QUrl& server, QObject* parent)
     : QObject(parent), d(new Private(std::make_unique<ConnectionData>(server)))
 {
     d->q = this; // All d initialization should occur before this line
+    d->cacheWriterPool.setMaxThreadCount(1);
+    d->syncSliceTimer.setSingleShot(true);
+    d->syncSliceTimer.setInterval(0);
+    connect(&d->syncSliceTimer, &QTimer::timeout, this, [this] {
+        if (d->roomApplyOrder.empty())
+            d->startApplyingSyncBatch();
+        else
+            d->applySyncSlice();
+    });
 }
 
 Connection::Connection(QObject* parent) : Connection({}, parent) {}
@@ -162,6 +246,8 @@ Connection::~Connection()
 {
     qCDebug(MAIN) << "deconstructing connection object for" << userId();
     stopSync();
+    d->writeDirtyRooms();
+    d->cacheWriterPool.waitForDone();
 }
 
 void Connection::resolveServer(const QString& mxid)
@@ -335,12 +421,10 @@ void Connection::checkAndConnect(const QString& userId,
 void Connection::logout()
 {
     // If there's an ongoing sync job, stop it but don't break the sync loop yet
-    const auto syncWasRunning = bool(d->syncJob);
+    const auto syncWasRunning =
+        d->syncJob || d->syncParsingWatcher || d->applyingSyncData;
     if (syncWasRunning)
-    {
-        d->syncJob->abandon();
-        d->syncJob = nullptr;
-    }
+        d->dropSyncInProgress();
     const auto* job = callApi<LogoutJob>();
     connect(job, &LogoutJob::finished, this, [this, job, syncWasRunning] {
         if (job->status().good() || job->error() == BaseJob::Unauthorised
@@ -361,26 +445,48 @@ void Connection::sync(int timeout)
         qCInfo(MAIN) << d->syncJob << "is already running";
         return;
     }
+    if (d->syncParsingWatcher) {
+        qCInfo(MAIN) << "The previous sync response is still being parsed";
+        return;
+    }
 
     d->syncTimeout = timeout;
     Filter filter;
     filter.room.edit().timeline.edit().limit.emplace(100);
     filter.room.edit().state.edit().lazyLoadMembers.emplace(d->lazyLoading);
-    auto job = d->syncJob =
-        callApi<SyncJob>(BackgroundRequest, d->data->lastEvent(), filter,
-                         timeout);
-    connect(job, &SyncJob::success, this, [this, job] {
-        onSyncSuccess(job->takeData());
+    const auto filterParam = d->syncFilterParam(filter);
+    const auto usesFilterId = filterParam == d->syncFilterId;
+    // In pipelined mode, batches that are not applied yet can be queued;
+    // the next sync should follow the latest of them.
+    const auto since = d->pendingSyncBatches.empty()
+                           ? d->data->lastEvent()
+                           : d->pendingSyncBatches.back().nextBatch();
+    auto job = d->syncJob = new SyncJob(since, filterParam, timeout);
+    // Incremental parsing already keeps the main thread responsive
+    const auto parseInBackground =
+        d->backgroundSyncParsing && !d->incrementalSyncParsing;
+    job->setIncrementalParsing(d->incrementalSyncParsing);
+    job->setDeferredParsing(parseInBackground);
+    run(job, BackgroundRequest);
+    connect(job, &SyncJob::success, this, [this, job, parseInBackground] {
         d->syncJob = nullptr;
-        emit syncDone();
+        if (parseInBackground)
+            d->parseSyncInBackground(job->takeRawResponse());
+        else
+            d->consumeSyncData(job->takeData());
     });
     connect(job, &SyncJob::retryScheduled, this,
             [this, job](int retriesTaken, int nextInMilliseconds) {
                 emit networkError(job->errorString(), job->rawDataSample(),
                                   retriesTaken, nextInMilliseconds);
             });
-    connect(job, &SyncJob::failure, this, [this, job] {
+    connect(job, &SyncJob::failure, this, [this, job, usesFilterId] {
         d->syncJob = nullptr;
+        // The server might have lost the filter; register it anew next time
+        if (usesFilterId
+            && (job->error() == BaseJob::IncorrectRequestError
+                || job->error() == BaseJob::NotFoundError))
+            d->syncFilterId.clear();
         if (job->error() == BaseJob::Unauthorised) {
             qCWarning(SYNCJOB)
                 << "Sync job failed with Unauthorised - login expired?";
@@ -409,7 +515,357 @@ void Connection::syncLoop(int timeout)
     }
 }
 
-void Connection::syncLoopIteration() { sync(d->syncTimeout); }
+void Connection::syncLoopIteration()
+{
+    // In pipelined mode, the next sync is started without waiting for
+    // syncDone() so there's nothing to do if it's already underway
+    if (d->pipelinedSync && (d->syncJob || d->syncParsingWatcher))
+        return;
+    sync(d->syncTimeout);
+}
+
+QString Connection::Private::syncFilterParam(const Filter& filter)
+{
+    const auto filterJson =
+        QJsonDocument(toJson(filter)).toJson(QJsonDocument::Compact);
+    if (filterJson != syncFilterJson) {
+        qCDebug(MAIN) << "Sync filter changed, registering it";
+        syncFilterJson = filterJson;
+        syncFilterId.clear();
+        syncFilterRejected = false;
+        if (defineFilterJob) {
+            defineFilterJob->abandon();
+            defineFilterJob = nullptr;
+        }
+    }
+    if (!syncFilterId.isEmpty())
+        return syncFilterId;
+
+    if (!defineFilterJob && !syncFilterRejected) {
+        auto* job = defineFilterJob =
+            q->callApi<DefineFilterJob>(BackgroundRequest, data->userId(),
+                                        filter);
+        QObject::connect(job, &BaseJob::result, q, [this, job] {
+            if (job != defineFilterJob)
+                return;
+            defineFilterJob = nullptr;
+            if (!job->status().good()) {
+                // Only give up on the filter if the server refused it;
+                // after network errors and such, try again on the next sync.
+                // An expired login is not a verdict on the filter either:
+                // once the access token is renewed it can be registered.
+                switch (job->error()) {
+                case BaseJob::ContentAccessError:
+                case BaseJob::NotFoundError:
+                case BaseJob::IncorrectRequestError:
+                case BaseJob::RequestNotImplementedError:
+                    qCWarning(MAIN) << "The server rejected the sync filter;"
+                                       " inline filter will be used";
+                    syncFilterRejected = true;
+                    break;
+                default:
+                    qCWarning(MAIN) << "Failed to register the sync filter,"
+                                       " will retry with the next sync";
+                }
+                return;
+            }
+            syncFilterId = job->filterId();
+            qCDebug(MAIN) << "Sync filter registered with id" << syncFilterId;
+        });
+    }
+    // Until the filter id arrives, pass the filter inline
+    return QString::fromUtf8(filterJson);
+}
+
+void Connection::Private::consumeSyncData(SyncData&& syncData)
+{
+    pendingSyncBatches.push_back(std::move(syncData));
+    // Fire the next long-poll before applying the batch; the batches are
+    // still applied strictly in the order of arrival.
+    if (pipelinedSync && syncLoopConnection)
+        q->syncLoopIteration();
+    if (applyingSyncData)
+        return; // Queued for the loop below, further up the stack
+
+    startApplyingSyncBatch();
+}
+
+void Connection::Private::startApplyingSyncBatch()
+{
+    applyingSyncData = true;
+    // The sync token is only advanced by onSyncSuccess(), once the whole
+    // batch is applied
+    auto& batch = pendingSyncBatches.front();
+    roomsToApply = batch.takeRoomData();
+
+    // Rooms the user is likely to look at go first; otherwise the order
+    // of the batch is preserved
+    const auto rank = [this](const SyncRoomData& rd) {
+        const auto* r =
+            roomMap.value({ rd.roomId, rd.joinState == JoinState::Invite });
+        if (r && r->displayed())
+            return 0;
+        if (r && r->isFavourite())
+            return 1;
+        if (rd.highlightCount > 0 || (r && r->highlightCount() > 0))
+            return 2;
+        return 3;
+    };
+    std::vector<std::pair<int, size_t>> ranks;
+    ranks.reserve(roomsToApply.size());
+    for (size_t i = 0; i < roomsToApply.size(); ++i)
+        ranks.emplace_back(rank(roomsToApply[i]), i);
+    std::sort(ranks.begin(), ranks.end());
+    roomApplyOrder.clear();
+    roomApplyOrder.reserve(ranks.size());
+    for (const auto& p : ranks)
+        roomApplyOrder.push_back(p.second);
+    roomsApplied = 0;
+
+    applySyncSlice();
+}
+
+void Connection::Private::applySyncSlice()
+{
+    QElapsedTimer et;
+    et.start();
+    while (roomsApplied < roomApplyOrder.size()) {
+        // Room::updateData() emits signals, and a handler may stop the sync
+        // (see dropSyncInProgress()), clearing roomsToApply; so the room data
+        // are moved out of it before applying
+        auto roomData =
+            std::move(roomsToApply[roomApplyOrder[roomsApplied++]]);
+        applyRoomData(std::move(roomData), false);
+        if (!applyingSyncData)
+            return; // The sync has been stopped while applying the room
+
+        // Let the event loop run between slices, instead of processing
+        // events in a nested loop
+        if (roomsApplied < roomApplyOrder.size()
+            && std::chrono::nanoseconds(et.nsecsElapsed()) >= syncSliceBudget) {
+            syncSliceTimer.start();
+            return;
+        }
+    }
+    roomsToApply.clear();
+    roomApplyOrder.clear();
+
+    // The room data are taken away already; onSyncSuccess() only does
+    // the rest of the batch
+    auto batch = std::move(pendingSyncBatches.front());
+    pendingSyncBatches.pop_front();
+    q->onSyncSuccess(std::move(batch));
+    emit q->syncDone();
+
+    if (pendingSyncBatches.empty())
+        applyingSyncData = false;
+    else
+        syncSliceTimer.start();
+}
+
+void Connection::Private::applyRoomData(SyncRoomData&& roomData,
+                                        bool fromCache)
+{
+    // The sync data come on top of the cached state; make sure it's there
+    if (!fromCache)
+        loadIndexedRoom(roomData.roomId);
+    const auto forgetIdx = roomIdsToForget.indexOf(roomData.roomId);
+    if (forgetIdx != -1) {
+        roomIdsToForget.removeAt(forgetIdx);
+        if (roomData.joinState == JoinState::Leave) {
+            qDebug(MAIN)
+                << "Room" << roomData.roomId
+                << "has been forgotten, ignoring /sync response for it";
+            return;
+        }
+        qWarning(MAIN) << "Room" << roomData.roomId
+                       << "has just been forgotten but /sync returned it in"
+                       << toCString(roomData.joinState)
+                       << "state - suspiciously fast turnaround";
+    }
+    // Incremental data go on top of the state being recovered, whether
+    // they are older or newer than it; the room drops the events it has
+    // got with the state already
+    if (!fromCache) {
+        if (const auto it = heldRoomData.find(roomData.roomId);
+            it != heldRoomData.end()) {
+            it->second.push_back(std::move(roomData));
+            return;
+        }
+    }
+    if (auto* r = q->provideRoom(roomData.roomId, roomData.joinState)) {
+        pendingStateRoomIds.removeOne(roomData.roomId);
+        r->updateData(std::move(roomData), fromCache);
+        if (firstTimeRooms.removeOne(r)) {
+            emit q->loadedRoomState(r);
+            if (capabilities.roomVersions)
+                r->checkVersion();
+            // Otherwise, the version will be checked in reloadCapabilities()
+        }
+    }
+}
+
+void Connection::Private::loadIndexedRoom(const QString& roomId)
+{
+    if (!unloadedRoomIds.remove(roomId))
+        return;
+
+    QElapsedTimer et;
+    et.start();
+    const auto json = SyncData::loadJson(
+        q->stateCacheDir().filePath(SyncData::fileNameForRoom(roomId)));
+    if (json.isEmpty()) {
+        recoverRooms({ roomId });
+        return;
+    }
+    applyRoomData(SyncRoomData(roomId, JoinState::Join, json), true);
+    qCDebug(PROFILER) << "Cached state of" << roomId << "loaded in" << et;
+}
+
+void Connection::Private::recoverRooms(const QStringList& roomIds,
+                                       int attempt)
+{
+    qCInfo(MAIN) << "Fetching the state of" << roomIds.size()
+                 << "room(s) that could not be loaded from the cache";
+    for (const auto& id : roomIds) {
+        roomIdsToRecover.insert(id);
+        heldRoomData[id]; // Hold the sync data for the room from now on
+    }
+
+    Filter filter;
+    filter.room.edit().rooms = roomIds;
+    filter.room.edit().timeline.edit().limit.emplace(20);
+    filter.room.edit().state.edit().lazyLoadMembers.emplace(lazyLoading);
+    // An initial sync limited to the broken rooms; its next_batch is not
+    // used, so the normal sync still continues from the cached token
+    auto* job = q->callApi<SyncJob>(BackgroundRequest, QString(), filter);
+    QObject::connect(job, &BaseJob::success, q, [this, job, roomIds] {
+        for (auto&& roomData : job->takeData().takeRoomData())
+            if (roomIdsToRecover.remove(roomData.roomId)) {
+                heldRoomData.erase(roomData.roomId);
+                applyRoomData(std::move(roomData), false);
+            }
+        for (const auto& id : roomIds)
+            if (roomIdsToRecover.remove(id))
+                qCWarning(MAIN) << "Room" << id
+                                << "is not in the sync response, dropping it";
+        applyHeldRoomData(roomIds);
+    });
+    QObject::connect(job, &BaseJob::failure, q, [this, roomIds, attempt] {
+        // The rooms may have been removed in the meantime
+        QStringList remainingIds;
+        for (const auto& id : roomIds)
+            if (roomIdsToRecover.contains(id))
+                remainingIds.push_back(id);
+        if (remainingIds.isEmpty())
+            return;
+        static constexpr auto MaxAttempts = 3;
+        if (attempt + 1 < MaxAttempts) {
+            const auto delay = std::chrono::seconds(10) * (attempt + 1);
+            qCWarning(MAIN) << "Could not recover" << remainingIds.size()
+                            << "room(s); retrying in" << delay.count()
+                            << "seconds";
+            QTimer::singleShot(delay, q, [this, remainingIds, attempt] {
+                QStringList ids;
+                for (const auto& id : remainingIds)
+                    if (roomIdsToRecover.contains(id))
+                        ids.push_back(id);
+                if (!ids.isEmpty())
+                    recoverRooms(ids, attempt + 1);
+            });
+            return;
+        }
+        qCWarning(MAIN) << "Could not recover" << remainingIds.size()
+                        << "room(s); they will be retried on the next start";
+        // Don't stall the rooms until then
+        applyHeldRoomData(remainingIds);
+    });
+}
+
+void Connection::Private::applyHeldRoomData(const QStringList& roomIds)
+{
+    for (const auto& id : roomIds) {
+        const auto it = heldRoomData.find(id);
+        if (it == heldRoomData.end())
+            continue;
+        auto heldData = std::move(it->second);
+        heldRoomData.erase(it);
+        for (auto&& roomData : heldData)
+            applyRoomData(std::move(roomData), false);
+    }
+}
+
+struct BackgroundSyncResult {
+    SyncData data;
+    QString errorString;
+    QString errorDetails;
+    QElapsedTimer handOffTimer;
+};
+
+void Connection::Private::parseSyncInBackground(QByteArray&& rawData)
+{
+    // The watcher only touches the result after the worker is done with it
+    const auto result = std::make_shared<BackgroundSyncResult>();
+    auto* watcher = syncParsingWatcher = new QFutureWatcher<void>(q);
+    QObject::connect(
+        watcher, &QFutureWatcherBase::finished, q, [this, watcher, result] {
+            watcher->deleteLater();
+            if (watcher != syncParsingWatcher)
+                return; // The sync has been stopped meanwhile; drop the result
+            syncParsingWatcher = nullptr;
+            qCDebug(PROFILER) << "*** Sync data handed over from the worker in"
+                              << result->handOffTimer;
+            if (!result->errorString.isEmpty()) {
+                emit q->syncError(result->errorString, result->errorDetails);
+                return;
+            }
+            consumeSyncData(std::move(result->data));
+        });
+    watcher->setFuture(QtConcurrent::run([result,
+                                          rawData = std::move(rawData)] {
+        QElapsedTimer et;
+        et.start();
+        QJsonParseError error { 0, QJsonParseError::MissingObject };
+        const auto json = QJsonDocument::fromJson(rawData, &error);
+        if (error.error == QJsonParseError::NoError) {
+            result->data.parseJson(json.object());
+            const auto& unresolvedRooms = result->data.unresolvedRooms();
+            if (!unresolvedRooms.isEmpty()) {
+                result->errorString = tr("Incomplete sync response");
+                result->errorDetails = tr("Missing rooms: %1")
+                                           .arg(unresolvedRooms.join(','));
+            }
+        } else {
+            result->errorString = error.errorString();
+            result->errorDetails = QString::fromUtf8(rawData.left(500));
+        }
+        qCDebug(PROFILER) << "*** Sync response parsed on a worker thread in"
+                          << et;
+        result->handOffTimer.start();
+    }));
+}
+
+void Connection::Private::dropSyncInProgress()
+{
+    if (syncJob) {
+        syncJob->abandon();
+        syncJob = nullptr;
+    }
+    // The worker cannot be interrupted but its result will be ignored
+    syncParsingWatcher = nullptr;
+
+    // Nothing received so far should be applied anymore; a partially applied
+    // batch is fetched again from the last completed one on the next sync
+    syncSliceTimer.stop();
+    if (!pendingSyncBatches.empty())
+        qCDebug(MAIN) << "Dropping" << pendingSyncBatches.size()
+                      << "sync batch(es) not applied yet";
+    pendingSyncBatches.clear();
+    roomsToApply.clear();
+    roomApplyOrder.clear();
+    roomsApplied = 0;
+    applyingSyncData = false;
+}
 
 QJsonObject toJson(const DirectChatsMap& directChats)
 {
@@ -427,34 +883,9 @@ QJsonObject toJson(const DirectChatsMap& directChats)
 void Connection::onSyncSuccess(SyncData&& data, bool fromCache)
 {
     d->data->setLastEvent(data.nextBatch());
-    for (auto&& roomData : data.takeRoomData()) {
-        const auto forgetIdx = d->roomIdsToForget.indexOf(roomData.roomId);
-        if (forgetIdx != -1) {
-            d->roomIdsToForget.removeAt(forgetIdx);
-            if (roomData.joinState == JoinState::Leave) {
-                qDebug(MAIN)
-                    << "Room" << roomData.roomId
-                    << "has been forgotten, ignoring /sync response for it";
-                continue;
-            }
-            qWarning(MAIN) << "Room" << roomData.roomId
-                           << "has just been forgotten but /sync returned it in"
-                           << toCString(roomData.joinState)
-                           << "state - suspiciously fast turnaround";
-        }
-        if (auto* r = provideRoom(roomData.roomId, roomData.joinState)) {
-            d->pendingStateRoomIds.removeOne(roomData.roomId);
-            r->updateData(std::move(roomData), fromCache);
-            if (d->firstTimeRooms.removeOne(r)) {
-                emit loadedRoomState(r);
-                if (d->capabilities.roomVersions)
-                    r->checkVersion();
-                // Otherwise, the version will be checked in reloadCapabilities()
-            }
-        }
-        // Let UI update itself after updating each room
-        QCoreApplication::processEvents();
-    }
+    for (auto&& roomData : data.takeRoomData())
+        d->applyRoomData(std::move(roomData), fromCache);
+
     // After running this loop, the account data events not saved in
     // d->accountData (see the end of the loop body) are auto-cleaned away
     for (auto& eventPtr : data.takeAccountData()) {
@@ -541,11 +972,8 @@ void Connection::stopSync()
 {
     // If there's a sync loop, break it
     disconnect(d->syncLoopConnection);
-    if (d->syncJob) // If there's an ongoing sync job, stop it too
-    {
-        d->syncJob->abandon();
-        d->syncJob = nullptr;
-    }
+    // If there's an ongoing sync job or parsing, stop it too
+    d->dropSyncInProgress();
 }
 
 QString Connection::nextBatchToken() const { return d->data->lastEvent(); }
@@ -1083,13 +1511,23 @@ DirectChatsMap Connection::directChats() const
 // Removes room with given id from roomMap
 void Connection::Private::removeRoom(const QString& roomId)
 {
+    unloadedRoomIds.remove(roomId);
+    roomIdsToRecover.remove(roomId);
+    heldRoomData.erase(roomId);
     for (auto f : { false, true })
         if (auto r = roomMap.take({ roomId, f })) {
+            dirtyRooms.remove(r);
             qCDebug(MAIN) << "Room" << r->objectName() << "in state"
                           << toCString(r->joinState()) << "will be deleted";
             emit r->beforeDestruction(r);
+            r->dropPersistentTimeline();
             r->deleteLater();
         }
+    // The room may have never been loaded in this session; its timeline
+    // store can still be on disk
+    if (q->cacheState())
+        QFile::remove(q->stateCacheDir().filePath(
+            TimelineStore::fileNameForRoom(roomId)));
 }
 
 void Connection::addToDirectChats(const Room* room, User* user)
@@ -1277,21 +1715,62 @@ void Connection::saveRoomState(Room* r) const
     Q_ASSERT(r);
     if (!d->cacheState)
         return;
+    // Saving a room that is only restored from the index would overwrite
+    // its state cache with an empty state
+    if (r->joinState() == JoinState::Join
+        && d->unloadedRoomIds.contains(r->id()))
+        return;
 
-    QFile outRoomFile { stateCacheDir().filePath(
-        SyncData::fileNameForRoom(r->id())) };
-    if (outRoomFile.open(QFile::WriteOnly)) {
-        QJsonDocument json { r->toJson() };
-        auto data = d->cacheToBinary ? json.toBinaryData()
-                                     : json.toJson(QJsonDocument::Compact);
-        outRoomFile.write(data.data(), data.size());
-        qCDebug(MAIN) << "Room state cache saved to" << outRoomFile.fileName();
-    } else {
-        qCWarning(MAIN) << "Error opening" << outRoomFile.fileName() << ":"
-                        << outRoomFile.errorString();
+    d->dirtyRooms.insert(r);
+    if (!d->cacheWriteScheduled) {
+        d->cacheWriteScheduled = true;
+        QTimer::singleShot(d->cacheWriteDelay, this,
+                           [this] { d->writeDirtyRooms(); });
     }
 }
 
+static void writeCacheFile(const QString& fileName, const QJsonObject& json,
+                           SyncData::CacheFormat format)
+{
+    QSaveFile outFile { fileName };
+    if (!outFile.open(QFile::WriteOnly)) {
+        qCWarning(MAIN) << "Error opening" << outFile.fileName() << ":"
+                        << outFile.errorString();
+        return;
+    }
+    const auto data = SyncData::encodeCache(json, format);
+    outFile.write(data.data(), data.size());
+    if (outFile.commit())
+        qCDebug(MAIN) << "Room state cache saved to" << fileName;
+    else
+        qCWarning(MAIN) << "Error writing" << fileName << ":"
+                        << outFile.errorString();
+}
+
+void Connection::Private::writeDirtyRooms()
+{
+    cacheWriteScheduled = false;
+    if (dirtyRooms.isEmpty())
+        return;
+
+    QElapsedTimer et;
+    et.start();
+    const auto cacheDir = q->stateCacheDir();
+    // Room::toJson() has to run in the room's thread; only the serialisation
+    // and the file I/O go to the writer thread
+    for (const auto* r : qAsConst(dirtyRooms))
+        QtConcurrent::run(&cacheWriterPool,
+                          [fileName = cacheDir.filePath(
+                               SyncData::fileNameForRoom(r->id())),
+                           json = r->toJson(), format = cacheFormat] {
+                              writeCacheFile(fileName, json, format);
+                          });
+    if (dirtyRooms.size() > 9 || et.nsecsElapsed() >= profilerMinNsecs())
+        qCDebug(PROFILER) << dirtyRooms.size()
+                          << "room(s) queued for caching in" << et;
+    dirtyRooms.clear();
+}
+
 void Connection::saveState() const
 {
     if (!d->cacheState)
@@ -1300,7 +1779,13 @@ void Connection::saveState() const
     QElapsedTimer et;
     et.start();
 
-    QFile outFile { d->topLevelStatePath() };
+    // Make sure the room files are up to date before the top-level file
+    // refers to them
+    d->writeDirtyRooms();
+    d->cacheWriterPool.waitForDone();
+
+    // A crash while writing should not leave a truncated index of the rooms
+    QSaveFile outFile { d->topLevelStatePath() };
     if (!outFile.open(QFile::WriteOnly)) {
         qCWarning(MAIN) << "Error opening" << outFile.fileName() << ":"
                         << outFile.errorString();
@@ -1318,12 +1803,20 @@ void Connection::saveState() const
     {
         QJsonObject roomsJson;
         QJsonObject inviteRoomsJson;
+        QJsonObject roomIndexJson;
         for (const auto* r: qAsConst(d->roomMap)) {
             if (r->joinState() == JoinState::Leave)
                 continue;
             (r->joinState() == JoinState::Invite ? inviteRoomsJson : roomsJson)
                 .insert(r->id(), QJsonValue::Null);
+            if (r->joinState() == JoinState::Join)
+                roomIndexJson.insert(r->id(), r->toIndexJson());
         }
+        // Keep the rooms being recovered in the list, so that they are
+        // recovered again if the client quits before that is done
+        for (const auto& id : qAsConst(d->roomIdsToRecover))
+            if (!roomsJson.contains(id) && !inviteRoomsJson.contains(id))
+                roomsJson.insert(id, QJsonValue::Null);
 
         QJsonObject roomObj;
         if (!roomsJson.isEmpty())
@@ -1333,7 +1826,16 @@ void Connection::saveState() const
 
         rootObj.insert(QStringLiteral("next_batch"), d->data->lastEvent());
         rootObj.insert(QStringLiteral("rooms"), roomObj);
+        if (!roomIndexJson.isEmpty())
+            rootObj.insert(SyncData::RoomIndexKey, roomIndexJson);
     }
+    if (!d->syncFilterId.isEmpty())
+        rootObj.insert(
+            SyncData::SyncFilterKey,
+            QJsonObject {
+                { QStringLiteral("filter_id"), d->syncFilterId },
+                { QStringLiteral("filter"),
+                  QJsonDocument::fromJson(d->syncFilterJson).object() } });
     {
         QJsonArray accountDataEvents {
             basicEventJson(QStringLiteral("m.direct"), toJson(d->directChats))
@@ -1347,13 +1849,15 @@ void Connection::saveState() const
                            { QStringLiteral("events"), accountDataEvents } });
     }
 
-    QJsonDocument json { rootObj };
-    auto data = d->cacheToBinary ? json.toBinaryData()
-                                 : json.toJson(QJsonDocument::Compact);
+    const auto data = SyncData::encodeCache(rootObj, d->cacheFormat);
     qCDebug(PROFILER) << "Cache for" << userId() << "generated in" << et;
 
     outFile.write(data.data(), data.size());
-    qCDebug(MAIN) << "State cache saved to" << outFile.fileName();
+    if (outFile.commit())
+        qCDebug(MAIN) << "State cache saved to" << outFile.fileName();
+    else
+        qCWarning(MAIN) << "Error writing" << outFile.fileName() << ":"
+                        << outFile.errorString();
 }
 
 void Connection::loadState()
@@ -1364,19 +1868,50 @@ void Connection::loadState()
     QElapsedTimer et;
     et.start();
 
-    SyncData sync { d->topLevelStatePath() };
+    SyncData sync { d->topLevelStatePath(), d->lazyCacheLoading };
     if (sync.nextBatch().isEmpty()) // No token means no cache by definition
         return;
 
-    if (!sync.unresolvedRooms().isEmpty()) {
-        qCWarning(MAIN) << "State cache incomplete, discarding";
-        return;
+    // Rooms that failed to load are fetched from the server separately,
+    // while the rest of the cache is used as normal
+    const auto unresolvedRooms = sync.unresolvedRooms();
+    const auto syncFilter = sync.syncFilter();
+    const auto filterId = syncFilter.value("filter_id"_ls).toString();
+    if (!filterId.isEmpty() && d->syncFilterJson.isEmpty()) {
+        d->syncFilterId = filterId;
+        d->syncFilterJson =
+            QJsonDocument(syncFilter.value("filter"_ls).toObject())
+                .toJson(QJsonDocument::Compact);
+    }
+    if (d->lazyCacheLoading) {
+        // The rooms with an index entry have been skipped by SyncData;
+        // restore them from the index, leaving the rest for later
+        const auto roomIndex = sync.roomIndex();
+        for (auto it = roomIndex.begin(); it != roomIndex.end(); ++it) {
+            auto* r = provideRoom(it.key(), JoinState::Join);
+            if (!r)
+                continue;
+            r->loadIndexJson(it->toObject());
+            d->unloadedRoomIds.insert(r->id());
+            connect(r, &Room::displayedChanged, this,
+                    [this, roomId = r->id()](bool displayed) {
+                        if (displayed)
+                            d->loadIndexedRoom(roomId);
+                    });
+        }
     }
-    // TODO: to handle load failures, instead of the above block:
-    // 1. Do initial sync on failed rooms without saving the nextBatch token
-    // 2. Do the sync across all rooms as normal
+    const auto cacheFormat = sync.cacheFormat();
     onSyncSuccess(std::move(sync), true);
     qCDebug(PROFILER) << "*** Cached state for" << userId() << "loaded in" << et;
+    if (!unresolvedRooms.isEmpty())
+        d->recoverRooms(unresolvedRooms);
+    if (cacheFormat != d->cacheFormat) {
+        // All formats can be read, so the room files are converted gradually,
+        // as rooms are saved; this only gets the loaded rooms converted soon
+        qCDebug(MAIN) << "Converting the state cache to the configured format";
+        for (auto* r : qAsConst(d->roomMap))
+            saveRoomState(r);
+    }
 }
 
 QString Connection::stateCachePath() const
@@ -1401,6 +1936,127 @@ void Connection::setCacheState(bool newValue)
     }
 }
 
+bool Connection::backgroundSyncParsing() const
+{
+    return d->backgroundSyncParsing;
+}
+
+void Connection::setBackgroundSyncParsing(bool newValue)
+{
+    d->backgroundSyncParsing = newValue;
+}
+
+bool Connection::incrementalSyncParsing() const
+{
+    return d->incrementalSyncParsing;
+}
+
+void Connection::setIncrementalSyncParsing(bool newValue)
+{
+    d->incrementalSyncParsing = newValue;
+}
+
+bool Connection::pipelinedSync() const { return d->pipelinedSync; }
+
+void Connection::setPipelinedSync(bool newValue)
+{
+    d->pipelinedSync = newValue;
+}
+
+std::chrono::milliseconds Connection::syncSliceBudget() const
+{
+    return d->syncSliceBudget;
+}
+
+void Connection::setSyncSliceBudget(std::chrono::milliseconds budget)
+{
+    d->syncSliceBudget = budget;
+}
+
+bool Connection::cacheTimeline() const { return d->cacheTimeline; }
+
+void Connection::setCacheTimeline(bool newValue)
+{
+    d->cacheTimeline = newValue;
+}
+
+bool Connection::lazyCacheLoading() const { return d->lazyCacheLoading; }
+
+void Connection::setLazyCacheLoading(bool newValue)
+{
+    d->lazyCacheLoading = newValue;
+}
+
+std::chrono::milliseconds Connection::cacheWriteDelay() const
+{
+    return d->cacheWriteDelay;
+}
+
+void Connection::setCacheWriteDelay(std::chrono::milliseconds delay)
+{
+    d->cacheWriteDelay = delay;
+}
+
+bool Connection::timelineInsertion() const { return d->timelineInsertion; }
+
+void Connection::setTimelineInsertion(bool newValue)
+{
+    d->timelineInsertion = newValue;
+    if (!newValue && d->gapFilling) {
+        qCDebug(MAIN) << "Gap filling disabled along with timeline insertion";
+        setGapFilling(false);
+    }
+}
+
+bool Connection::gapFilling() const { return d->gapFilling; }
+
+void Connection::setGapFilling(bool newValue)
+{
+    d->gapFilling = newValue;
+    if (!newValue)
+        d->gapFillQueue.clear();
+    else if (!d->timelineInsertion) {
+        qCDebug(MAIN) << "Timeline insertion enabled for gap filling";
+        d->timelineInsertion = true;
+    }
+}
+
+int Connection::maxGapFillJobs() const { return d->maxGapFillJobs; }
+
+void Connection::setMaxGapFillJobs(int limit)
+{
+    d->maxGapFillJobs = std::max(limit, 1);
+    d->runGapFills();
+}
+
+void Connection::queueGapFill(Room* room)
+{
+    if (!d->gapFilling
+        || std::find(d->gapFillQueue.cbegin(), d->gapFillQueue.cend(), room)
+               != d->gapFillQueue.cend())
+        return;
+    d->gapFillQueue.emplace_back(room);
+    d->runGapFills();
+}
+
+void Connection::Private::runGapFills()
+{
+    while (gapFillJobsRunning < maxGapFillJobs && !gapFillQueue.empty()) {
+        const auto room = gapFillQueue.front();
+        gapFillQueue.pop_front();
+        if (!room)
+            continue;
+        auto* job = room->fillNextGap();
+        if (!job)
+            continue;
+        ++gapFillJobsRunning;
+        connect(job, &BaseJob::finished, q, [this] {
+            --gapFillJobsRunning;
+            runGapFills();
+        });
+    }
+}
+
 bool Connection::lazyLoading() const { return d->lazyLoading; }
 
 void Connection::setLazyLoading(bool newValue)
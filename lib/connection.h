@@ -30,6 +30,7 @@
 #include <QtCore/QSize>
 #include <QtCore/QUrl>
 
+#include <chrono>
 #include <functional>
 
 namespace QtOlm {
@@ -356,7 +357,14 @@ public:
      */
     Q_INVOKABLE void saveState() const;
 
-    /// This method saves the current state of a single room.
+    /// Schedule saving the current state of a single room
+    /** Rooms are not written right away; all rooms changed within
+     * cacheWriteDelay() are written together, so that a busy room gets
+     * at most one write per that period. The state is converted to JSON
+     * in the calling thread, while serialising and writing the file
+     * happen on a worker thread. saveState() writes all pending rooms
+     * before saving the top-level state.
+     */
     void saveRoomState(Room* r) const;
 
     /// Get the default directory path to save the room state to
@@ -382,9 +390,110 @@ public:
     bool cacheState() const;
     void setCacheState(bool newValue);
 
+    /// Whether room timelines are stored on disk along with the state cache
+    /** When enabled (and cacheState() is on), each room keeps an
+     * append-only store of its timeline events next to its state cache
+     * file. The stored events are added to the timeline when the room is
+     * displayed or asked for more history with Room::getPreviousContent(),
+     * so that history is there right after a restart without fetching it
+     * from the server. Gaps left by limited syncs are stored along with
+     * the tokens to fill them, and so are events that fill gaps later.
+     * Disabled by default.
+     * \sa TimelineStore
+     */
+    bool cacheTimeline() const;
+    void setCacheTimeline(bool newValue);
+
+    /// Whether loadState() only loads the room index from the state cache
+    /** In this mode loadState() restores joined rooms from a compact index
+     * saved along with the state cache: the summary, the display name,
+     * the tags and the unread counters. The full cached state of a room is
+     * only loaded when the room is displayed (see Room::setDisplayed()) or
+     * when a sync response brings data for it. Disabled by default.
+     * \sa loadState
+     */
+    bool lazyCacheLoading() const;
+    void setLazyCacheLoading(bool newValue);
+
+    /// The period to collect room changes before writing them to the cache
+    /** Defaults to 1 second. \sa saveRoomState */
+    std::chrono::milliseconds cacheWriteDelay() const;
+    void setCacheWriteDelay(std::chrono::milliseconds delay);
+
+    /// Whether events can be inserted in the middle of room timelines
+    /** Normally, events only come to either end of a room timeline and
+     * every event keeps its timeline index while it's in the timeline.
+     * When this is enabled, events that fill a gap (see gapFilling()) or
+     * a fragment that meets the timeline in the middle (see
+     * Room::loadEventContext()) are inserted in place, which resets
+     * the timeline indices, see Room::aboutToInsertMessages(). Otherwise
+     * such a fragment stays
+     * detached. Disabled by default.
+     */
+    bool timelineInsertion() const;
+    void setTimelineInsertion(bool newValue);
+
+    /// Whether gaps left in room timelines by limited syncs are filled
+    /** When enabled, the events that the server skipped in a limited sync
+     * response are fetched in the background for rooms that are displayed,
+     * favourite or have highlights, so that the user doesn't have to scroll
+     * through the gap to get them. The fetched events are inserted in
+     * the middle of the timeline, so enabling this enables
+     * timelineInsertion() as well, and disabling timelineInsertion()
+     * disables this. Disabled by default.
+     * \sa Room::hasGapBefore, maxGapFillJobs
+     */
+    bool gapFilling() const;
+    void setGapFilling(bool newValue);
+
+    /// The number of gap-filling requests that may run at the same time
+    /** The limit is shared by all rooms of the connection. Defaults to 2. */
+    int maxGapFillJobs() const;
+    void setMaxGapFillJobs(int limit);
+
     bool lazyLoading() const;
     void setLazyLoading(bool newValue);
 
+    /// Whether /sync responses are parsed on a worker thread
+    /** When enabled, the body of a /sync response is passed to a thread
+     * pool where SyncData is built; only the finished SyncData is handed
+     * back to the thread of the Connection object for onSyncSuccess().
+     * The parsing and hand-off times are logged to the profiler category.
+     * Disabled by default.
+     */
+    bool backgroundSyncParsing() const;
+    void setBackgroundSyncParsing(bool newValue);
+
+    /// Whether /sync responses are decoded while being received
+    /** When enabled, rooms from a /sync response are decoded as soon as
+     * their data arrive, overlapping the download with decoding; the whole
+     * response is never held as a single JSON document, which caps
+     * the memory peak on large initial syncs. Overrides
+     * backgroundSyncParsing(). Disabled by default.
+     * \sa SyncStreamParser
+     */
+    bool incrementalSyncParsing() const;
+    void setIncrementalSyncParsing(bool newValue);
+
+    /// Whether the sync loop fires the next sync before applying the data
+    /** In pipelined mode the sync loop (see syncLoop()) starts the next
+     * long-poll as soon as a sync response is parsed, instead of waiting
+     * until the data are applied to rooms and syncDone() is emitted. Sync
+     * batches are still applied, and syncDone() emitted, strictly in
+     * the order they were received. Disabled by default.
+     */
+    bool pipelinedSync() const;
+    void setPipelinedSync(bool newValue);
+
+    /// Time budget for applying a sync batch before yielding to the event loop
+    /** Rooms from a /sync response are applied in slices; once a slice
+     * takes longer than this budget, the next one is scheduled after
+     * pending events are processed. Rooms that are displayed, favourite or
+     * have highlights are applied first. Defaults to 10 ms.
+     */
+    std::chrono::milliseconds syncSliceBudget() const;
+    void setSyncSliceBudget(std::chrono::milliseconds budget);
+
     /*! Start a pre-created job object on this connection */
     void run(BaseJob* job, RunningPolicy runningPolicy = ForegroundRequest) const;
 
@@ -792,9 +901,17 @@ protected slots:
     void syncLoopIteration();
 
 private:
+    friend class Room;
+
     class Private;
     QScopedPointer<Private> d;
 
+    // Called from Room to queue fetching the events missing in its
+    // timeline; does nothing unless gapFilling() is enabled. Each turn of
+    // a room runs one request; rooms with more to fetch queue themselves
+    // again, so that a room with a large gap doesn't hold up other rooms.
+    void queueGapFill(Room* room);
+
     /**
      * A single entry for functions that need to check whether the
      * homeserver is valid before running. May either execute connectFn
@@ -21,28 +21,306 @@
 #include "logging.h"
 
 #include <QtCore/QJsonDocument>
+#include <QtCore/QMutex>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
 
 using namespace Quotient;
 
-event_type_t EventTypeRegistry::initializeTypeId(event_mtype_t matrixTypeId)
+namespace {
+using handle_t = InternedStrings::handle_t;
+
+class InternTable {
+public:
+    InternTable() { add({}); }
+    ~InternTable()
+    {
+        for (auto& segment : segments)
+            delete[] segment.load();
+    }
+    Q_DISABLE_COPY(InternTable)
+    DISABLE_MOVE(InternTable)
+
+    /// Find the string in the table, adding it if \p canAdd
+    handle_t find(const QString& s, bool canAdd)
+    {
+        QMutexLocker _(&mutex);
+        if (const auto it = handles.constFind(s); it != handles.cend())
+            return *it;
+        return canAdd ? add(s) : InternedStrings::InvalidHandle;
+    }
+
+    /// Get the string by its handle; doesn't lock
+    const QString* string(handle_t handle) const
+    {
+        // Strings are stored before the size is increased (see add()),
+        // and never move afterwards
+        if (handle >= size.load(std::memory_order_acquire))
+            return nullptr;
+        return segments[handle / SegmentSize].load(std::memory_order_acquire)
+               + handle % SegmentSize;
+    }
+
+private:
+    static constexpr handle_t SegmentSize = 4096;
+    /// Strings are never removed, so the table is bounded; with the table
+    /// full, new strings are used without interning (see StateEventKey)
+    static constexpr handle_t MaxSegments = 64;
+
+    /// Guards `handles`, `full` and adding strings
+    QMutex mutex;
+    QHash<QString, handle_t> handles;
+    bool full = false;
+    std::atomic<handle_t> size { 0 };
+    std::array<std::atomic<QString*>, MaxSegments> segments {};
+
+    handle_t add(const QString& s)
+    {
+        const auto handle = size.load(std::memory_order_relaxed);
+        if (handle / SegmentSize >= MaxSegments) {
+            if (!std::exchange(full, true))
+                qCWarning(EVENTS) << "The table of interned strings is full;"
+                                  << "new strings will not be interned";
+            return InternedStrings::InvalidHandle;
+        }
+        auto& segment = segments[handle / SegmentSize];
+        auto* strings = segment.load(std::memory_order_relaxed);
+        if (!strings) {
+            strings = new QString[SegmentSize];
+            segment.store(strings, std::memory_order_release);
+        }
+        strings[handle % SegmentSize] = s;
+        handles.insert(s, handle);
+        size.store(handle + 1, std::memory_order_release);
+        return handle;
+    }
+};
+
+InternTable& internTable()
+{
+    static InternTable table;
+    return table;
+}
+
+/// The handles of the strings already used on this thread; the keys share
+/// their data with the strings in the table
+thread_local QHash<QString, handle_t> localHandles;
+thread_local bool lookupOnly = false;
+/// Beyond that, the thread's cache is started anew rather than growing
+/// to a copy of the whole table on each thread
+constexpr int MaxLocalHandles = 16 * 1024;
+
+handle_t findHandle(const QString& s, bool canAdd)
+{
+    if (const auto it = localHandles.constFind(s); it != localHandles.cend())
+        return *it;
+    const auto handle = internTable().find(s, canAdd);
+    if (handle == InternedStrings::InvalidHandle)
+        return handle;
+    if (localHandles.size() >= MaxLocalHandles)
+        localHandles.clear();
+    localHandles.insert(*internTable().string(handle), handle);
+    return handle;
+}
+} // namespace
+
+handle_t InternedStrings::intern(const QString& s)
+{
+    return findHandle(s, !lookupOnly);
+}
+
+handle_t InternedStrings::lookup(const QString& s)
+{
+    return findHandle(s, false);
+}
+
+QString InternedStrings::string(handle_t handle)
+{
+    const auto* s = internTable().string(handle);
+    return s ? *s : QString();
+}
+
+InternedStrings::LookupOnlyScope::LookupOnlyScope()
+    : outerValue(std::exchange(lookupOnly, true))
+{}
+
+InternedStrings::LookupOnlyScope::~LookupOnlyScope()
+{
+    lookupOnly = outerValue;
+}
+
+struct alignas(std::max_align_t) EventArenaScope::Chunk {
+    static constexpr size_t MinSize = 2 * 1024;
+    static constexpr size_t MaxSize = 64 * 1024;
+
+    static Chunk* create(size_t size);
+    void release();
+    /// The allocatable memory goes right after the chunk header
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+
+    const size_t size;
+    size_t used = 0;
+    /// One reference for each event in the chunk plus one for the scope
+    /// that allocates from it
+    std::atomic<int> refCount { 1 };
+
+    static std::atomic<size_t> totalSize;
+};
+
+std::atomic<size_t> EventArenaScope::Chunk::totalSize { 0 };
+
+EventArenaScope::Chunk* EventArenaScope::Chunk::create(size_t size)
+{
+    auto* chunk = new (::operator new(sizeof(Chunk) + size)) Chunk { size };
+    totalSize += size;
+    return chunk;
+}
+
+void EventArenaScope::Chunk::release()
 {
-    const auto id = get().eventTypes.size();
-    get().eventTypes.push_back(matrixTypeId);
-    if (strncmp(matrixTypeId, "", 1) == 0)
-        qDebug(EVENTS) << "Initialized unknown event type with id" << id;
+    if (--refCount > 0)
+        return;
+    totalSize -= size;
+    this->~Chunk();
+    ::operator delete(this);
+}
+
+namespace {
+constexpr size_t alignedSize(size_t size)
+{
+    return (size + alignof(std::max_align_t) - 1)
+           & ~(alignof(std::max_align_t) - 1);
+}
+
+/// Each event is preceded by the chunk it is allocated in, or nullptr
+constexpr size_t AllocationHeaderSize =
+    alignedSize(sizeof(EventArenaScope::Chunk*));
+
+EventArenaScope::Chunk*& allocationChunk(void* allocation)
+{
+    return *static_cast<EventArenaScope::Chunk**>(allocation);
+}
+
+EventArenaScope::Chunk* chunkOf(const Event* event)
+{
+    return *reinterpret_cast<EventArenaScope::Chunk* const*>(
+        reinterpret_cast<const char*>(event) - AllocationHeaderSize);
+}
+
+std::atomic<bool> arenasEnabled { false };
+thread_local EventArenaScope* currentArena = nullptr;
+} // namespace
+
+EventArenaScope::EventArenaScope()
+    : nextChunkSize(Chunk::MinSize), active(arenasEnabled)
+{
+    if (active)
+        outer = std::exchange(currentArena, this);
+}
+
+EventArenaScope::~EventArenaScope()
+{
+    if (!active)
+        return;
+    Q_ASSERT(currentArena == this);
+    currentArena = outer;
+    if (chunk)
+        chunk->release();
+}
+
+bool EventArenaScope::enabled() { return arenasEnabled; }
+
+void EventArenaScope::setEnabled(bool enabled) { arenasEnabled = enabled; }
+
+bool EventArenaScope::isInArena(const Event* event)
+{
+    return event && chunkOf(event);
+}
+
+size_t EventArenaScope::allocatedBytes() { return Chunk::totalSize; }
+
+void* EventArenaScope::allocate(size_t size)
+{
+    const auto fullSize = alignedSize(size);
+    // Large events would waste too much of a chunk
+    if (fullSize > Chunk::MaxSize / 4)
+        return nullptr;
+    if (!chunk || chunk->used + fullSize > chunk->size) {
+        if (chunk)
+            chunk->release();
+        while (nextChunkSize < fullSize)
+            nextChunkSize *= 2;
+        chunk = Chunk::create(nextChunkSize);
+        nextChunkSize = std::min(nextChunkSize * 2, Chunk::MaxSize);
+    }
+    auto* p = chunk->data() + chunk->used;
+    chunk->used += fullSize;
+    ++chunk->refCount;
+    return p;
+}
+
+void* Event::operator new(size_t size)
+{
+    const auto fullSize = AllocationHeaderSize + size;
+    void* p = nullptr;
+    EventArenaScope::Chunk* chunk = nullptr;
+    if (currentArena)
+        if ((p = currentArena->allocate(fullSize)))
+            chunk = currentArena->chunk;
+    if (!p)
+        p = ::operator new(fullSize);
+    allocationChunk(p) = chunk;
+    return static_cast<char*>(p) + AllocationHeaderSize;
+}
+
+void Event::operator delete(void* ptr)
+{
+    if (!ptr)
+        return;
+    auto* p = static_cast<char*>(ptr) - AllocationHeaderSize;
+    if (auto* chunk = allocationChunk(p))
+        chunk->release();
     else
+        ::operator delete(p);
+}
+
+// Events can be loaded on worker threads, so types can be registered
+// from several threads at once
+static QMutex registryMutex;
+
+event_type_t EventTypeRegistry::initializeTypeId(event_mtype_t matrixTypeId)
+{
+    const auto id = eventTypeId(matrixTypeId);
+    QMutexLocker _(&registryMutex);
+    const auto it = get().eventTypes.constFind(id);
+    if (it == get().eventTypes.cend()) {
+        get().eventTypes.insert(id, matrixTypeId);
         qDebug(EVENTS) << "Initialized event type" << matrixTypeId << "with id"
                        << id;
+    } else if (strcmp(*it, matrixTypeId) != 0) {
+        // is<>(), eventCast<>() and visit() would take one type for
+        // the other, in release builds too; the type ids are compile-time
+        // constants, so this can't be worked around at runtime
+        qFatal("Event types %s and %s have the same type id %zu", *it,
+               matrixTypeId, size_t(id));
+    }
     return id;
 }
 
 QString EventTypeRegistry::getMatrixType(event_type_t typeId)
 {
-    return typeId < get().eventTypes.size() ? get().eventTypes[typeId]
-                                            : QString();
+    QMutexLocker _(&registryMutex);
+    return get().eventTypes.value(typeId);
 }
 
-Event::Event(Type type, const QJsonObject& json) : _type(type), _json(json)
+Event::Event(Type type, const QJsonObject& json)
+    : _type(type)
+    , _json(json)
+    , _matrixTypeHandle(InternedStrings::intern(json[TypeKeyL].toString()))
 {
     if (!json.contains(ContentKeyL)
         && !json.value(UnsignedKeyL).toObject().contains(RedactedCauseKeyL)) {
@@ -57,7 +335,12 @@ Event::Event(Type type, event_mtype_t matrixType, const QJsonObject& contentJson
 
 Event::~Event() = default;
 
-QString Event::matrixType() const { return fullJson()[TypeKeyL].toString(); }
+QString Event::matrixType() const
+{
+    return _matrixTypeHandle != InternedStrings::InvalidHandle
+               ? InternedStrings::string(_matrixTypeHandle)
+               : _json[TypeKeyL].toString();
+}
 
 QByteArray Event::originalJson() const { return QJsonDocument(_json).toJson(); }
 
@@ -21,6 +21,14 @@
 #include "converters.h"
 #include "logging.h"
 
+#include <QtCore/QHash>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <tuple>
+
 #ifdef ENABLE_EVENTTYPE_ALIAS
 #    define USE_EVENTTYPE_ALIAS 1
 #endif
@@ -83,21 +91,106 @@ inline QJsonObject basicEventJson(StrT matrixType, const QJsonObject& content)
 using event_type_t = size_t;
 using event_mtype_t = const char*;
 
+/// Calculate the type id of an event from its Matrix type
+/** The id is the FNV-1a hash of the Matrix type string, so it is known
+ * at compile time and doesn't depend on the order in which types are
+ * registered; two C++ types with the same Matrix type get the same id.
+ * Where event_type_t is narrower than 64 bits, the halves of the hash are
+ * folded together. EventTypeRegistry::initializeTypeId() stops the
+ * application if two registered Matrix types end up with the same id,
+ * since visit() and is<>() would confuse them.
+ */
+constexpr event_type_t eventTypeId(event_mtype_t matrixTypeId)
+{
+    std::uint64_t hash = 14695981039346656037ULL;
+    for (; *matrixTypeId != '\0'; ++matrixTypeId) {
+        hash ^= std::uint8_t(*matrixTypeId);
+        hash *= 1099511628211ULL;
+    }
+    if constexpr (sizeof(event_type_t) < sizeof(hash))
+        hash ^= hash >> 32;
+    return event_type_t(hash);
+}
+
+/// A process-wide table of strings repeated across many events
+/** Matrix types and state keys recur in a lot of events; interning them
+ * keeps a single shared copy of each string and gives it a small integer
+ * handle that is cheap to hash and compare. The table is process-wide
+ * rather than per connection because events are loaded outside of any
+ * connection, on worker threads too. Each thread keeps a bounded cache of
+ * handles, so only strings new to the thread take the table lock; strings
+ * are looked up by handle without locking. Strings are only added from
+ * the events that are loaded; queries use lookup() that never adds.
+ * The handle of the empty string is always 0.
+ *
+ * Strings are never removed, so the size of the table is capped. Once it
+ * is full, intern() returns InvalidHandle for new strings and the code
+ * using the handles falls back to the strings themselves.
+ */
+class InternedStrings {
+public:
+    using handle_t = quint32;
+    static constexpr handle_t InvalidHandle = ~handle_t(0);
+
+    /// Get the handle of a string, adding it to the table if needed
+    /** \sa LookupOnlyScope */
+    static handle_t intern(const QString& s);
+    /// Get the handle of a string if it's in the table, or InvalidHandle
+    static handle_t lookup(const QString& s);
+    static QString string(handle_t handle);
+
+    /// Make intern() on the current thread not add strings to the table
+    /** This is for objects that are made to answer a query, such as
+     * stub state events, and should not grow the table. intern() returns
+     * InvalidHandle for the strings that are not in the table yet.
+     */
+    class LookupOnlyScope {
+    public:
+        LookupOnlyScope();
+        ~LookupOnlyScope();
+        Q_DISABLE_COPY(LookupOnlyScope)
+        DISABLE_MOVE(LookupOnlyScope)
+
+    private:
+        bool outerValue;
+    };
+};
+
 class EventTypeRegistry {
 public:
     ~EventTypeRegistry() = default;
 
+    /// Remember the Matrix type for a type id, for getMatrixType()
+    /** Calls qFatal() if another Matrix type has the same id */
     static event_type_t initializeTypeId(event_mtype_t matrixTypeId);
 
     template <typename EventT>
     static inline event_type_t initializeTypeId()
     {
+        const auto matrixType = QString::fromLatin1(EventT::matrixTypeId());
+        typeHandle<EventT>.store(InternedStrings::intern(matrixType),
+                                 std::memory_order_relaxed);
         return initializeTypeId(EventT::matrixTypeId());
     }
 
     static QString getMatrixType(event_type_t typeId);
 
+    /// The handle of the Matrix type of EventT in InternedStrings
+    /** The type is interned once, when EventT is registered; this returns
+     * InvalidHandle for event types that are not registered.
+     */
+    template <typename EventT>
+    static InternedStrings::handle_t matrixTypeHandle()
+    {
+        return typeHandle<EventT>.load(std::memory_order_relaxed);
+    }
+
 private:
+    template <typename EventT>
+    static inline std::atomic<InternedStrings::handle_t> typeHandle {
+        InternedStrings::InvalidHandle
+    };
+
     EventTypeRegistry() = default;
     Q_DISABLE_COPY(EventTypeRegistry)
     DISABLE_MOVE(EventTypeRegistry)
@@ -108,31 +201,29 @@ private:
         return etr;
     }
 
-    std::vector<event_mtype_t> eventTypes;
+    QHash<event_type_t, event_mtype_t> eventTypes;
 };
 
-template <>
-inline event_type_t EventTypeRegistry::initializeTypeId<void>()
-{
-    return initializeTypeId("");
-}
-
 template <typename EventT>
 struct EventTypeTraits {
-    static event_type_t id()
+    static constexpr event_type_t id()
     {
-        static const auto id = EventTypeRegistry::initializeTypeId<EventT>();
-        return id;
+        return eventTypeId(EventT::matrixTypeId());
     }
 };
 
+template <>
+struct EventTypeTraits<void> {
+    static constexpr event_type_t id() { return eventTypeId(""); }
+};
+
 template <typename EventT>
-inline event_type_t typeId()
+constexpr event_type_t typeId()
 {
     return EventTypeTraits<std::decay_t<EventT>>::id();
 }
 
-inline event_type_t unknownEventTypeId() { return typeId<void>(); }
+constexpr event_type_t unknownEventTypeId() { return typeId<void>(); }
 
 // === EventFactory ===
 
@@ -146,10 +237,32 @@ inline event_ptr_tt<EventT> makeEvent(ArgTs&&... args)
 template <typename BaseEventT>
 class EventFactory {
 public:
+    using method_t = std::function<event_ptr_tt<BaseEventT>(
+        const QJsonObject&, const QString&)>;
+
+    /** Add a factory method for any event type
+     * Such methods are tried in the order of addition when no method
+     * is registered for the exact Matrix type of the event.
+     */
     template <typename FnT>
     static auto addMethod(FnT&& method)
     {
-        factories().emplace_back(std::forward<FnT>(method));
+        fallbackMethods().emplace_back(std::forward<FnT>(method));
+        return 0;
+    }
+
+    /** Add a factory method for a given Matrix type
+     * make() finds such methods with a single hash lookup by the type of
+     * the event; if there are several methods for the same type,
+     * the first one added is used.
+     */
+    template <typename FnT>
+    static auto addMethod(event_mtype_t matrixType, FnT&& method)
+    {
+        auto& methods = typedMethods();
+        const auto type = QString::fromLatin1(matrixType);
+        if (!methods.contains(type))
+            methods.insert(type, method_t(std::forward<FnT>(method)));
         return 0;
     }
 
@@ -170,19 +283,27 @@ public:
     static event_ptr_tt<BaseEventT> make(const QJsonObject& json,
                                          const QString& matrixType)
     {
-        for (const auto& f : factories())
+        const auto& methods = typedMethods();
+        if (const auto it = methods.constFind(matrixType);
+            it != methods.cend())
+            if (auto e = (*it)(json, matrixType))
+                return e;
+        for (const auto& f : fallbackMethods())
             if (auto e = f(json, matrixType))
                 return e;
         return nullptr;
     }
 
 private:
-    static auto& factories()
+    static auto& typedMethods()
+    {
+        static QHash<QString, method_t> _methods {};
+        return _methods;
+    }
+    static auto& fallbackMethods()
     {
-        using inner_factory_tt = std::function<event_ptr_tt<BaseEventT>(
-            const QJsonObject&, const QString&)>;
-        static std::vector<inner_factory_tt> _factories {};
-        return _factories;
+        static std::vector<method_t> _methods {};
+        return _methods;
     }
 };
 
@@ -199,11 +320,11 @@ template <typename EventT>
 inline auto setupFactory()
 {
     qDebug(EVENTS) << "Adding factory method for" << EventT::matrixTypeId();
-    return EventT::factory_t::addMethod([](const QJsonObject& json,
-                                           const QString& jsonMatrixType) {
-        return EventT::matrixTypeId() == jsonMatrixType ? makeEvent<EventT>(json)
-                                                        : nullptr;
-    });
+    EventTypeRegistry::initializeTypeId<EventT>();
+    return EventT::factory_t::addMethod(
+        EventT::matrixTypeId(), [](const QJsonObject& json, const QString&) {
+            return makeEvent<EventT>(json);
+        });
 }
 
 template <typename EventT>
@@ -216,6 +337,64 @@ inline auto registerEventType()
     return _; // Only to facilitate usage in static initialisation
 }
 
+// === Event allocation ===
+
+class Event;
+
+/// Allocate events made on the current thread in shared memory chunks
+/**
+ * While an object of this class exists, events created on the same thread
+ * (by makeEvent<>(), loadEvent<>() or otherwise) are placed next to each
+ * other in memory chunks instead of being allocated one by one. This
+ * saves malloc calls and keeps events of one batch close in memory.
+ * Events retain the usual ownership semantics: each of them can be deleted
+ * at any time, on any thread; a chunk is freed once all events in it are
+ * deleted and the scope is gone.
+ *
+ * This trades memory for speed: a single live event pins its whole chunk,
+ * up to 64 KB. To limit that, the first chunk of a scope is small and
+ * each next one is twice as large, up to the limit; and scopes should only
+ * be opened for events that are dropped together, not for long-lived ones
+ * such as room state. An event that outlives the rest of its batch anyway
+ * (e.g. a state event from the timeline that is still current when older
+ * events are evicted) keeps its chunk until it is replaced. Scopes can be
+ * nested, the innermost one being used. Does nothing unless enabled with
+ * setEnabled().
+ *
+ * Every event allocated with new, in a chunk or not, is preceded by
+ * a pointer-sized header with its chunk (or nullptr), so deleting an event
+ * takes no lookups or locks.
+ */
+class EventArenaScope {
+public:
+    EventArenaScope();
+    ~EventArenaScope();
+    Q_DISABLE_COPY(EventArenaScope)
+    DISABLE_MOVE(EventArenaScope)
+
+    /// Whether scopes allocate events; disabled by default
+    static bool enabled();
+    static void setEnabled(bool enabled);
+
+    /// Whether the event is allocated in a chunk of some scope
+    /** The event must have been allocated with new. */
+    static bool isInArena(const Event* event);
+    /// The total size of the chunks that are currently allocated
+    static size_t allocatedBytes();
+
+    struct Chunk;
+
+private:
+    friend class Event;
+
+    void* allocate(size_t size);
+
+    Chunk* chunk = nullptr;
+    size_t nextChunkSize;
+    EventArenaScope* outer = nullptr;
+    bool active;
+};
+
 // === Event ===
 
 class Event {
@@ -236,6 +415,11 @@ public:
 
     Type type() const { return _type; }
     QString matrixType() const;
+    /// The handle of matrixType() in InternedStrings
+    InternedStrings::handle_t matrixTypeHandle() const
+    {
+        return _matrixTypeHandle;
+    }
     QByteArray originalJson() const;
     QJsonObject originalJsonObject() const { return fullJson(); }
 
@@ -272,12 +456,18 @@ public:
     virtual bool isCallEvent() const { return false; }
     virtual void dumpTo(QDebug dbg) const;
 
+    /// Allocate the event in the current EventArenaScope, if there's one
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
 protected:
     QJsonObject& editJson() { return _json; }
 
 private:
     Type _type;
     QJsonObject _json;
+    /// The Matrix type itself is only taken from _json if it's not interned
+    InternedStrings::handle_t _matrixTypeHandle;
 };
 using EventPtr = event_ptr_tt<Event>;
 
@@ -289,9 +479,9 @@ using Events = EventsArray<Event>;
 
 // This macro should be used in a public section of an event class to
 // provide matrixTypeId() and typeId().
-#define DEFINE_EVENT_TYPEID(_Id, _Type)                           \
-    static constexpr event_mtype_t matrixTypeId() { return _Id; } \
-    static auto typeId() { return Quotient::typeId<_Type>(); }    \
+#define DEFINE_EVENT_TYPEID(_Id, _Type)                                  \
+    static constexpr event_mtype_t matrixTypeId() { return _Id; }        \
+    static constexpr auto typeId() { return Quotient::typeId<_Type>(); } \
     // End of macro
 
 // This macro should be put after an event class definition (in .h or .cpp)
@@ -309,6 +499,8 @@ using Events = EventsArray<Event>;
 template <typename EventT>
 inline bool is(const Event& e)
 {
+    // typeId<>() is a compile-time constant, so this is a single comparison
+    // (unless specialised, as is<StateEventBase>() is)
     return e.type() == typeId<EventT>();
 }
 
@@ -366,16 +558,146 @@ visit(const BaseEventT& event, FnT&& visitor,
     return std::forward<fn_return_t<FnT>>(defaultValue);
 }
 
+namespace _impl {
+    template <typename EventT, typename = void>
+    constexpr bool has_type_id_v = false;
+    template <typename EventT>
+    constexpr bool has_type_id_v<
+        EventT, std::void_t<decltype(EventT::matrixTypeId())>> = true;
+
+    /// Whether the visitor only accepts events with a single type id
+    /** This is the case for leaf event types: is<>() for them is
+     * a comparison of type ids. Base types such as StateEventBase don't
+     * have a Matrix type of their own and are checked otherwise.
+     */
+    template <typename BaseEventT, typename FnT>
+    constexpr bool is_leaf_visitor()
+    {
+        return needs_downcast<BaseEventT, FnT>()
+               && has_type_id_v<std::decay_t<fn_arg_t<FnT>>>;
+    }
+
+    template <size_t N>
+    struct TypeIdTable {
+        std::array<event_type_t, N> ids {};
+        std::array<size_t, N> visitorIndices {};
+        size_t size = 0;
+    };
+
+    /// Sort type ids for the lookup, keeping the first visitor for each id
+    template <size_t N>
+    constexpr TypeIdTable<N>
+    makeTypeIdTable(const std::array<event_type_t, N>& ids)
+    {
+        TypeIdTable<N> table;
+        for (size_t i = 0; i < N; ++i) {
+            size_t pos = 0;
+            while (pos < table.size && table.ids[pos] < ids[i])
+                ++pos;
+            if (pos < table.size && table.ids[pos] == ids[i])
+                continue; // An earlier visitor takes events of this type
+            for (auto j = table.size; j > pos; --j) {
+                table.ids[j] = table.ids[j - 1];
+                table.visitorIndices[j] = table.visitorIndices[j - 1];
+            }
+            table.ids[pos] = ids[i];
+            table.visitorIndices[pos] = i;
+            ++table.size;
+        }
+        return table;
+    }
+
+    /// Dispatch a chain of visitors on event.type() with a table lookup
+    /** Applicable when all visitors but the last are leaf visitors, and
+     * the last one is either a leaf visitor or a generic catch-all.
+     */
+    template <typename RetT, typename BaseEventT, typename... FnTs>
+    struct TypeIdDispatcher {
+        using visitors_t = std::tuple<std::remove_reference_t<FnTs>&...>;
+        using last_visitor_t =
+            std::tuple_element_t<sizeof...(FnTs) - 1, std::tuple<FnTs...>>;
+
+        static constexpr bool HasCatchAll =
+            !needs_downcast<BaseEventT, last_visitor_t>();
+        static constexpr size_t LeafCount = sizeof...(FnTs) - HasCatchAll;
+
+        template <size_t... Is>
+        static constexpr bool allLeaves(std::index_sequence<Is...>)
+        {
+            return (is_leaf_visitor<
+                        BaseEventT,
+                        std::tuple_element_t<Is, std::tuple<FnTs...>>>()
+                    && ...);
+        }
+        static constexpr bool Applicable =
+            allLeaves(std::make_index_sequence<LeafCount>());
+
+        template <size_t I>
+        static RetT call(const BaseEventT& event, visitors_t& visitors)
+        {
+            using event_type =
+                fn_arg_t<std::tuple_element_t<I, std::tuple<FnTs...>>>;
+            return std::get<I>(visitors)(static_cast<event_type>(event));
+        }
+
+        template <size_t... Is>
+        static constexpr auto makeTable(std::index_sequence<Is...>)
+        {
+            return makeTypeIdTable<LeafCount>({ typeId<std::decay_t<fn_arg_t<
+                std::tuple_element_t<Is, std::tuple<FnTs...>>>>>()... });
+        }
+
+        using caller_t = RetT (*)(const BaseEventT&, visitors_t&);
+        template <size_t... Is>
+        static constexpr std::array<caller_t, LeafCount>
+        makeCallers(std::index_sequence<Is...>)
+        {
+            return { &call<Is>... };
+        }
+
+        static RetT dispatch(const BaseEventT& event, visitors_t visitors)
+        {
+            static constexpr auto Table =
+                makeTable(std::make_index_sequence<LeafCount>());
+            static constexpr auto Callers =
+                makeCallers(std::make_index_sequence<LeafCount>());
+
+            const auto idsEnd = Table.ids.cbegin() + Table.size;
+            const auto it =
+                std::lower_bound(Table.ids.cbegin(), idsEnd, event.type());
+            if (it != idsEnd && *it == event.type())
+                return Callers[Table.visitorIndices[it - Table.ids.cbegin()]](
+                    event, visitors);
+            if constexpr (HasCatchAll)
+                return std::get<LeafCount>(visitors)(event);
+            else if constexpr (!std::is_void_v<RetT>)
+                return RetT {};
+        }
+    };
+} // namespace _impl
+
 // A chain of 2 or more visitors
+// The visitors are tried in order; the first one accepting the event is
+// called. When all of them are for leaf event types (with an optional
+// catch-all in the end), the visitor is looked up by event.type() in a table
+// of type ids sorted at compile time; otherwise the visitors are checked
+// one by one with is<>().
 template <typename BaseEventT, typename FnT1, typename FnT2, typename... FnTs>
 inline fn_return_t<FnT1> visit(const BaseEventT& event, FnT1&& visitor1,
                                FnT2&& visitor2, FnTs&&... visitors)
 {
-    using event_type1 = fn_arg_t<FnT1>;
-    if (is<std::decay_t<event_type1>>(event))
-        return visitor1(static_cast<event_type1&>(event));
-    return visit(event, std::forward<FnT2>(visitor2),
-                 std::forward<FnTs>(visitors)...);
+    using dispatcher_t = _impl::TypeIdDispatcher<fn_return_t<FnT1>, BaseEventT,
+                                                 FnT1, FnT2, FnTs...>;
+    if constexpr (dispatcher_t::Applicable) {
+        return dispatcher_t::dispatch(event,
+                                      std::tie(visitor1, visitor2, visitors...));
+    } else {
+        using event_type1 = fn_arg_t<FnT1>;
+        if (is<std::decay_t<event_type1>>(event))
+            return visitor1(static_cast<event_type1&>(event));
+        return visit(event, std::forward<FnT2>(visitor2),
+                     std::forward<FnTs>(visitors)...);
+    }
 }
 } // namespace Quotient
 Q_DECLARE_METATYPE(Quotient::Event*)
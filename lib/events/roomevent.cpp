@@ -38,10 +38,31 @@ RoomEvent::RoomEvent(Type type, const QJsonObject& json) : Event(type, json)
     const auto redaction = unsignedData[RedactedCauseKeyL];
     if (redaction.isObject())
         _redactedBecause = makeEvent<RedactionEvent>(redaction.toObject());
+    if (const auto stateKey = json[StateKeyKeyL]; stateKey.isString())
+        _stateKeyHandle = InternedStrings::intern(stateKey.toString());
 }
 
 RoomEvent::~RoomEvent() = default; // Let the smart pointer do its job
 
+QString RoomEvent::stateKey() const
+{
+    return _stateKeyHandle != InternedStrings::InvalidHandle
+               ? InternedStrings::string(_stateKeyHandle)
+               : fullJson()[StateKeyKeyL].toString();
+}
+
+StateEventKey RoomEvent::stateEventKey() const
+{
+    // The strings are only needed for the parts that are not interned
+    const auto typeHandle = matrixTypeHandle();
+    return { typeHandle,
+             typeHandle == InternedStrings::InvalidHandle ? matrixType()
+                                                          : QString(),
+             _stateKeyHandle,
+             _stateKeyHandle == InternedStrings::InvalidHandle ? stateKey()
+                                                               : QString() };
+}
+
 QString RoomEvent::id() const { return fullJson()[EventIdKeyL].toString(); }
 
 QDateTime RoomEvent::originTimestamp() const
@@ -83,11 +104,6 @@ QString RoomEvent::transactionId() const
     return unsignedJson()["transaction_id"_ls].toString();
 }
 
-QString RoomEvent::stateKey() const
-{
-    return fullJson()[StateKeyKeyL].toString();
-}
-
 void RoomEvent::setRoomId(const QString& roomId)
 {
     editJson().insert(QStringLiteral("room_id"), roomId);
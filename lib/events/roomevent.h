@@ -25,6 +25,63 @@
 namespace Quotient {
 class RedactionEvent;
 
+/**
+ * A combination of event type and state key uniquely identifies a piece
+ * of state in Matrix. Both parts are normally kept as handles in
+ * InternedStrings, so that the key is cheap to hash and compare. A part
+ * that is not in the table (e.g. because the table is full) has
+ * InvalidHandle and is kept as a string instead, so that such keys don't
+ * collide with each other.
+ * \sa
+ * https://matrix.org/docs/spec/client_server/unstable.html#types-of-room-events
+ */
+struct StateEventKey {
+    using handle_t = InternedStrings::handle_t;
+
+    StateEventKey(handle_t typeHandle, const QString& matrixType,
+                  handle_t stateKeyHandle, const QString& stateKey)
+        : type(typeHandle)
+        , stateKey(stateKeyHandle)
+        , typeString(typeHandle == InternedStrings::InvalidHandle ? matrixType
+                                                                  : QString())
+        , stateKeyString(stateKeyHandle == InternedStrings::InvalidHandle
+                             ? stateKey
+                             : QString())
+    {}
+
+    bool operator==(const StateEventKey& other) const
+    {
+        return type == other.type && stateKey == other.stateKey
+               && typeString == other.typeString
+               && stateKeyString == other.stateKeyString;
+    }
+
+    handle_t type;
+    handle_t stateKey;
+    /// The strings for the parts that have InvalidHandle; empty otherwise
+    QString typeString;
+    QString stateKeyString;
+};
+
+inline uint qHash(const StateEventKey& key, uint seed = 0) noexcept
+{
+    const auto hash = qHash(qMakePair(key.type, key.stateKey), seed);
+    if (key.typeString.isEmpty() && key.stateKeyString.isEmpty())
+        return hash;
+    return hash ^ qHash(qMakePair(key.typeString, key.stateKeyString), seed);
+}
+
+/// Find the state event key for a Matrix type and a state key
+/** Nothing is added to InternedStrings; a string that is not there yet
+ * matches only the state keyed on that string (see StateEventKey).
+ */
+inline StateEventKey makeStateEventKey(const QString& matrixType,
+                                       const QString& stateKey)
+{
+    return { InternedStrings::lookup(matrixType), matrixType,
+             InternedStrings::lookup(stateKey), stateKey };
+}
+
 /** This class corresponds to m.room.* events */
 class RoomEvent : public Event {
     Q_GADGET
@@ -62,6 +119,7 @@ public:
     QString redactionReason() const;
     QString transactionId() const;
     QString stateKey() const;
+    StateEventKey stateEventKey() const;
 
     void setRoomId(const QString& roomId);
     void setSender(const QString& senderId);
@@ -89,6 +147,8 @@ public:
 
 private:
     event_ptr_tt<RedactionEvent> _redactedBecause;
+    /// The state key itself is only taken from the JSON if it's not interned
+    InternedStrings::handle_t _stateKeyHandle = 0;
 };
 using RoomEventPtr = event_ptr_tt<RoomEvent>;
 using RoomEvents = EventsArray<RoomEvent>;
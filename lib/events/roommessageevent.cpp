@@ -137,6 +137,7 @@ RoomMessageEvent::RoomMessageEvent(const QString& plainBody,
     : RoomEvent(typeId(), matrixTypeId(),
                 assembleContentJson(plainBody, jsonMsgType, content))
     , _content(content)
+    , _contentDecoded(true)
 {}
 
 RoomMessageEvent::RoomMessageEvent(const QString& plainBody, MsgType msgType,
@@ -179,8 +180,22 @@ RoomMessageEvent::RoomMessageEvent(const QString& plainBody,
 {}
 
 RoomMessageEvent::RoomMessageEvent(const QJsonObject& obj)
-    : RoomEvent(typeId(), obj), _content(nullptr)
+    : RoomEvent(typeId(), obj)
+{}
+
+const TypedBase* RoomMessageEvent::content() const
+{
+    decodeContent();
+    return _content.data();
+}
+
+void RoomMessageEvent::decodeContent() const
 {
+    // Events are only accessed from one thread at a time (they are handed
+    // over to the Room's thread after loading), so no locking is needed
+    if (_contentDecoded)
+        return;
+    _contentDecoded = true;
     if (isRedacted())
         return;
     const QJsonObject content = contentJson();
@@ -200,7 +215,7 @@ RoomMessageEvent::RoomMessageEvent(const QJsonObject& obj)
         }
     } else {
         qCWarning(EVENTS) << "No body or msgtype in room message event";
-        qCWarning(EVENTS) << formatJson << obj;
+        qCWarning(EVENTS) << formatJson << fullJson();
     }
 }
 
@@ -223,14 +238,15 @@ QMimeType RoomMessageEvent::mimeType() const
 {
     static const auto PlainTextMimeType =
         QMimeDatabase().mimeTypeForName("text/plain");
-    return _content ? _content->type() : PlainTextMimeType;
+    return content() ? content()->type() : PlainTextMimeType;
 }
 
 bool RoomMessageEvent::hasTextContent() const
 {
-    return !content()
-           || (msgtype() == MsgType::Text || msgtype() == MsgType::Emote
-               || msgtype() == MsgType::Notice);
+    // Check the message type first, to not decode text messages for that
+    const auto type = msgtype();
+    return type == MsgType::Text || type == MsgType::Emote
+           || type == MsgType::Notice || !content();
 }
 
 bool RoomMessageEvent::hasFileContent() const
@@ -243,15 +259,6 @@ bool RoomMessageEvent::hasThumbnail() const
     return content() && content()->thumbnailInfo();
 }
 
-QString RoomMessageEvent::replacedEvent() const
-{
-    if (!content() || !hasTextContent())
-        return {};
-
-    const auto& rel = static_cast<const TextContent*>(content())->relatesTo;
-    return isReplacement(rel) ? rel->eventId : QString();
-}
-
 QString rawMsgTypeForMimeType(const QMimeType& mimeType)
 {
     auto name = mimeType.name();
@@ -301,6 +308,24 @@ Omittable<RelatesTo> fromJson(const QJsonValue& jv)
 }
 } // namespace Quotient
 
+QString RoomMessageEvent::replacedEvent() const
+{
+    // This is checked for every incoming message, so the relation is read
+    // from JSON without decoding the whole content; relations are only
+    // supported in text messages
+    if (isRedacted())
+        return {};
+    const auto content = contentJson();
+    const auto type = jsonToMsgType(content[MsgTypeKeyL].toString());
+    if (!content.contains(BodyKeyL)
+        || (type != MsgType::Text && type != MsgType::Emote
+            && type != MsgType::Notice))
+        return {};
+
+    const auto rel = fromJson<Omittable<RelatesTo>>(content[RelatesToKeyL]);
+    return isReplacement(rel) ? rel->eventId : QString();
+}
+
 TextContent::TextContent(const QJsonObject& json)
     : relatesTo(fromJson<Omittable<RelatesTo>>(json[RelatesToKeyL]))
 {
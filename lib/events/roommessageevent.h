@@ -62,10 +62,15 @@ public:
     MsgType msgtype() const;
     QString rawMsgtype() const;
     QString plainBody() const;
-    const EventContent::TypedBase* content() const { return _content.data(); }
+    /// The typed content of the message
+    /** The content is decoded from JSON on the first call and cached in
+     * the event, so that messages that are never shown don't pay for it.
+     */
+    const EventContent::TypedBase* content() const;
     template <typename VisitorT>
     void editContent(VisitorT&& visitor)
     {
+        decodeContent();
         visitor(*_content);
         editJson()[ContentKeyL] = assembleContentJson(plainBody(), rawMsgtype(),
                                                       _content.data());
@@ -80,7 +85,10 @@ public:
     static QString rawMsgTypeForFile(const QFileInfo& fi);
 
 private:
-    QScopedPointer<EventContent::TypedBase> _content;
+    mutable QScopedPointer<EventContent::TypedBase> _content;
+    mutable bool _contentDecoded = false;
+
+    void decodeContent() const;
 
     // FIXME: should it really be static?
     static QJsonObject assembleContentJson(const QString& plainBody,
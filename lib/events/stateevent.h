@@ -59,14 +59,6 @@ inline bool is<StateEventBase>(const Event& e)
     return e.isStateEvent();
 }
 
-/**
- * A combination of event type and state key uniquely identifies a piece
- * of state in Matrix.
- * \sa
- * https://matrix.org/docs/spec/client_server/unstable.html#types-of-room-events
- */
-using StateEventKey = QPair<QString, QString>;
-
 template <typename ContentT>
 struct Prev {
     template <typename... ContentParamTs>
@@ -18,6 +18,8 @@
 
 #include "syncjob.h"
 
+#include <QtNetwork/QNetworkReply>
+
 using namespace Quotient;
 
 static size_t jobId = 0;
@@ -49,9 +51,54 @@ SyncJob::SyncJob(const QString& since, const Filter& filter, int timeout,
               timeout, presence)
 {}
 
+void SyncJob::onSentRequest(QNetworkReply* reply)
+{
+    if (!incrementalParsing)
+        return;
+
+    // A retry starts over with a new reply
+    streamParser = std::make_unique<SyncStreamParser>();
+    connect(reply, &QIODevice::readyRead, this, [this, reply] {
+        // Only stream successful responses; error bodies are left in
+        // the reply for gotReply() to deal with
+        const auto httpCode =
+            reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
+        if (!status().good() || !httpCode.isValid()
+            || httpCode.toInt() / 100 != 2)
+            return;
+        streamParser->feed(reply->read(reply->bytesAvailable()));
+    });
+}
+
+BaseJob::Status SyncJob::parseReply(QNetworkReply* reply)
+{
+    if (incrementalParsing) {
+        Q_ASSERT(streamParser);
+        QElapsedTimer et;
+        et.start();
+        if (!streamParser->feed(reply->readAll()) || !streamParser->finish())
+            return { IncorrectResponseError, streamParser->errorString() };
+        d = streamParser->takeData();
+        streamParser.reset();
+        qCDebug(PROFILER) << "*** SyncJob::parseReply(): finished incremental"
+                             " parsing in" << et;
+        return checkUnresolvedRooms();
+    }
+    if (!deferParsing)
+        return BaseJob::parseReply(reply);
+
+    rawResponse = reply->readAll();
+    return BaseJob::Success;
+}
+
 BaseJob::Status SyncJob::parseJson(const QJsonDocument& data)
 {
     d.parseJson(data.object());
+    return checkUnresolvedRooms();
+}
+
+BaseJob::Status SyncJob::checkUnresolvedRooms() const
+{
     if (d.unresolvedRooms().isEmpty())
         return BaseJob::Success;
 
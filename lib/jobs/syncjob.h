@@ -32,10 +32,37 @@ public:
 
     SyncData&& takeData() { return std::move(d); }
 
+    /// Leave the response body unparsed
+    /** With deferred parsing enabled, the job doesn't fill SyncData from
+     * the response; the body can be obtained with takeRawResponse() upon
+     * success and parsed elsewhere (e.g., on a worker thread).
+     */
+    void setDeferredParsing(bool deferred) { deferParsing = deferred; }
+    QByteArray&& takeRawResponse() { return std::move(rawResponse); }
+
+    /// Decode the response while it is being received
+    /** With incremental parsing enabled, chunks of the response body are
+     * passed to SyncStreamParser as they arrive, and rooms are decoded
+     * without waiting for the rest of the response or building a JSON
+     * document for all of it. Takes precedence over deferred parsing.
+     */
+    void setIncrementalParsing(bool incremental)
+    {
+        incrementalParsing = incremental;
+    }
+
 protected:
+    void onSentRequest(QNetworkReply* reply) override;
+    Status parseReply(QNetworkReply* reply) override;
     Status parseJson(const QJsonDocument& data) override;
 
 private:
     SyncData d;
+    QByteArray rawResponse;
+    std::unique_ptr<SyncStreamParser> streamParser;
+    bool deferParsing = false;
+    bool incrementalParsing = false;
+
+    Status checkUnresolvedRooms() const;
 };
 } // namespace Quotient
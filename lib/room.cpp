@@ -23,10 +23,12 @@
 #include "converters.h"
 #include "e2ee.h"
 #include "syncdata.h"
+#include "timelinestore.h"
 #include "user.h"
 
 #include "csapi/account-data.h"
 #include "csapi/banning.h"
+#include "csapi/event_context.h"
 #include "csapi/inviting.h"
 #include "csapi/kicking.h"
 #include "csapi/leaving.h"
@@ -68,6 +70,8 @@
 #include <array>
 #include <cmath>
 #include <functional>
+#include <list>
+#include <map>
 #include <groupsession.h> // QtOlm
 #include <message.h> // QtOlm
 #include <session.h> // QtOlm
@@ -81,6 +85,74 @@ using std::llround;
 
 enum EventsPlacement : int { Older = -1, Newer = 1 };
 
+static const auto DisplaynameIndexKey =
+    QStringLiteral("x-quotient.display_name");
+
+/// Counts of flagged timeline events in ranges of timeline indices
+/**
+ * The counts are kept in two Fenwick trees: one for the non-negative
+ * indices of events added by syncs and one for the negative indices of
+ * historical events (see TimelineItem::index()). Either end of the timeline
+ * can grow, and a flag can be changed or a range counted, in O(log n).
+ */
+class TimelineCounter {
+public:
+    using index_t = TimelineItem::index_t;
+
+    void set(index_t index, bool flag)
+    {
+        if (index >= 0)
+            newer.set(size_t(index), flag);
+        else
+            older.set(size_t(-1 - index), flag);
+    }
+
+    /// The number of flagged events with indices in [from, to)
+    int count(index_t from, index_t to) const
+    {
+        return from < to ? countBefore(to) - countBefore(from) : 0;
+    }
+
+private:
+    struct Tree {
+        std::vector<int> sums;
+        std::vector<bool> flags;
+
+        /// The number of flagged positions in [0, n)
+        int prefix(size_t n) const
+        {
+            int result = 0;
+            for (n = std::min(n, sums.size()); n > 0; n &= n - 1)
+                result += sums[n - 1];
+            return result;
+        }
+        void set(size_t pos, bool flag)
+        {
+            while (flags.size() <= pos) {
+                // A new node covers (i - lowbit(i), i] in 1-based positions
+                const auto i = sums.size() + 1;
+                sums.push_back(prefix(i - 1) - prefix(i - (i & (0 - i))));
+                flags.push_back(false);
+            }
+            if (flags[pos] == flag)
+                return;
+            flags[pos] = flag;
+            for (auto i = pos + 1; i <= sums.size(); i += i & (0 - i))
+                sums[i - 1] += flag ? 1 : -1;
+        }
+    };
+    Tree newer;
+    Tree older;
+
+    /// The number of flagged events with indices less than \p index
+    /** The total of historical events is left out as it cancels out */
+    int countBefore(index_t index) const
+    {
+        return index >= 0 ? newer.prefix(size_t(index))
+                          : -older.prefix(size_t(-index));
+    }
+};
+
 class Room::Private {
 public:
     /// Map of user names to users
@@ -101,7 +173,7 @@ public:
     /// \sa timelineBase
     UnorderedMap<StateEventKey, StateEventPtr> baseState;
     /// State event stubs - events without content, just type and state key
-    static decltype(baseState) stubbedState;
+    static UnorderedMap<QPair<QString, QString>, StateEventPtr> stubbedState;
     /// The state of the room at timeline position after-maxTimelineIndex()
     /// \sa Room::syncEdge
     QHash<StateEventKey, const StateEventBase*> currentState;
@@ -111,30 +183,87 @@ public:
 
     Timeline timeline;
     PendingEvents unsyncedEvents;
+    /// Keys of events in unsyncedEvents, in the same order
+    /** The keys of events don't change as other events are removed, so
+     * the position of an event is found by its key with a binary search
+     * instead of updating the positions of all events after the removed one.
+     */
+    std::vector<quint64> unsyncedKeys;
+    quint64 nextUnsyncedKey = 0;
+    /// Keys of events in unsyncedEvents by their transaction ids
+    QHash<QString, quint64> unsyncedTxnIndex;
     QHash<QString, TimelineItem::index_t> eventsIndex;
+    /// Notable events (see isEventNotable()) by timeline indices
+    TimelineCounter notableEvents;
     // A map from evtId to a map of relation type to a vector of event
     // pointers. Not using QMultiHash, because we want to quickly return
     // a number of relations for a given event without enumerating them.
     QHash<QPair<QString, QString>, RelatedEvents> relations;
+    /// Whether relations of evicted events have been dropped; these are
+    /// restored when the events are loaded again
+    bool relatedEventsEvicted = false;
     QString displayname;
     Avatar avatar;
     int highlightCount = 0;
     int notificationCount = 0;
     members_map_t membersMap;
     QList<User*> usersTyping;
-    QMultiHash<QString, User*> eventIdReadUsers;
     QList<User*> usersInvited;
     QList<User*> membersLeft;
     int unreadMessages = 0;
     bool displayed = false;
     QString firstDisplayedEventId;
     QString lastDisplayedEventId;
-    QHash<const User*, QString> lastReadEventIds;
+    /// The read receipt of a user
+    struct ReadReceipt {
+        QString eventId;
+        /// Whether the event is in the timeline, at \p index
+        bool inTimeline = false;
+        /// Whether the event has been evicted from the timeline; it is then
+        /// older than all the events in the timeline
+        bool evicted = false;
+        TimelineItem::index_t index = 0;
+    };
+    QHash<const User*, ReadReceipt> readReceipts;
+    /// Users with read receipts at each timeline index, in the order
+    /// the receipts arrived
+    QHash<TimelineItem::index_t, QList<User*>> readUsersAtIndex;
+    /// Users with read receipts at events not in the timeline, by event id;
+    /// they move to readUsersAtIndex when the events are loaded
+    QHash<QString, QList<User*>> readUsersAtMissingEvent;
     QString serverReadMarker;
     TagsMap tags;
     UnorderedMap<QString, EventPtr> accountData;
     QString prevBatch;
     QPointer<GetRoomEventsJob> eventsHistoryJob;
+    /// The on-disk copy of the timeline, see Connection::cacheTimeline()
+    std::unique_ptr<TimelineStore> timelineStore;
+    bool timelineStoreDropped = false;
+    bool restoringTimeline = false;
+    /// Tokens to paginate back from the events at given timeline indices
+    std::map<TimelineItem::index_t, QString> paginationTokens;
+    int timelineLimit = 0;
+    /// Tokens to fill the gaps in the timeline, by the id of the event
+    /// right after each gap
+    QHash<QString, QString> gapTokens;
+    /// The gap being filled in the background, see Connection::gapFilling()
+    QString gapFillEventId; //< The event right after the gap
+    QString gapFillToken; //< Where the next request continues from
+    RoomEvents gapFillEvents; //< Fetched so far, from the newest
+    int gapFillPages = 0;
+    QPointer<GetRoomEventsJob> gapFillJob;
+
+    /// A part of the room history detached from the timeline
+    struct TimelineFragment {
+        RoomEvents events; //< From the oldest to the newest
+        QString prevBatch; //< The token to paginate back from `events`
+        QString nextBatch; //< The token to paginate forward from `events`
+        QPointer<GetRoomEventsJob> job {};
+    };
+    using fragments_t = std::list<TimelineFragment>;
+    fragments_t fragments;
+    /// The fragments that have the events, by event ids
+    QHash<QString, fragments_t::iterator> fragmentIndex;
     QPointer<GetMembersByRoomJob> allMembersJob;
 
     struct FileTransferPrivateInfo {
@@ -203,41 +332,133 @@ public:
 
     void getPreviousContent(int limit = 10);
 
-    const StateEventBase* getCurrentState(const StateEventKey& evtKey) const
+    /// The timeline store of the room, or nullptr if not enabled
+    TimelineStore* persistentTimeline();
+    /// Add events from the timeline store before the oldest loaded one
+    /// \return whether any events have been added
+    bool loadFromTimelineStore(int limit);
+    /// Drop the oldest events from memory to fit in timelineLimit
+    void evictOldEvents();
+    /// Remove the events older than the given index from the timeline
+    /** The events that make the current state are moved to baseState and
+     * the rest are deleted.
+     */
+    void detachEventsBefore(TimelineItem::index_t newFrontIndex);
+    /// Insert events in the middle of the timeline
+    /** The events, from the newest to the oldest, are put right before
+     * the event with \p beforeIndex. To make room for them, the events on
+     * the side with fewer events are renumbered: the newer ones get higher
+     * indices or the older ones get lower indices. Only to be used with
+     * Connection::timelineInsertion() enabled.
+     */
+    void insertEventsBefore(TimelineItem::index_t beforeIndex,
+                            RoomEvents&& events);
+
+    /// Record the gap before the event, or remove it if the token is empty
+    /** The gap is recorded both in memory and in the timeline store. */
+    void setGapBefore(const QString& eventId, const QString& token);
+    /// Ask the connection to fill the gaps in the timeline, if it's worth it
+    void requestGapFill();
+    void onGapFillPage(GetRoomEventsJob* job);
+    /// Put the events fetched for the gap into the timeline
+    void insertGapEvents(bool gapClosed);
+
+    fragments_t::iterator findFragment(const QString& eventId);
+    /// Remove the fragment and return its events, from the oldest
+    RoomEvents takeFragmentEvents(fragments_t::iterator f);
+    void addFragment(RoomEvents&& events, const QString& eventId,
+                     const QString& prevBatch, const QString& nextBatch);
+    /// Add events to a fragment, joining it with other fragments or
+    /// the timeline if the events overlap with them
+    /** \param events the events in the order of \p placement, i.e. from
+     *         the newest to the oldest for Older and vice versa for Newer
+     *  \return the fragment with the events, or fragments.end() if it has
+     *          been merged into the timeline
+     */
+    fragments_t::iterator extendFragment(fragments_t::iterator f,
+                                         RoomEvents&& events,
+                                         EventsPlacement placement,
+                                         const QString& token);
+    /// Put the events of the fragment into the timeline
+    /** \param meetIndex the timeline event the fragment has reached
+     *  \param placement the direction in which the fragment has been
+     *         extended to reach the event
+     *  \return whether the fragment has been merged
+     */
+    bool mergeFragmentIntoTimeline(fragments_t::iterator f,
+                                   TimelineItem::index_t meetIndex,
+                                   EventsPlacement placement);
+    void getFragmentContent(const QString& eventId, int limit,
+                            EventsPlacement placement);
+
+    const StateEventBase* getCurrentState(const QString& matrixType,
+                                          const QString& stateKey) const
     {
-        const auto* evt = currentState.value(evtKey, nullptr);
-        if (!evt) {
-            if (stubbedState.find(evtKey) == stubbedState.end()) {
-                // In the absence of a real event, make a stub as-if an event
-                // with empty content has been received. Event classes should be
-                // prepared for empty/invalid/malicious content anyway.
-                stubbedState.emplace(evtKey, loadStateEvent(evtKey.first, {},
-                                                            evtKey.second));
-                qCDebug(STATE) << "A new stub event created for key {"
-                               << evtKey.first << evtKey.second << "}";
-            }
-            evt = stubbedState[evtKey].get();
-            Q_ASSERT(evt);
-        }
-        Q_ASSERT(evt->matrixType() == evtKey.first
-                 && evt->stateKey() == evtKey.second);
-        return evt;
+        if (const auto* evt = currentState.value(
+                makeStateEventKey(matrixType, stateKey), nullptr))
+            return evt;
+        return getStubState(matrixType, stateKey);
     }
 
     template <typename EventT>
     const EventT* getCurrentState(const QString& stateKey = {}) const
     {
-        const auto* evt = getCurrentState({ EventT::matrixTypeId(), stateKey });
+        // Interned when EventT is registered, so no lookup is needed here
+        const auto typeHandle = EventTypeRegistry::matrixTypeHandle<EventT>();
+        const auto* evt =
+            typeHandle != InternedStrings::InvalidHandle
+                ? currentState.value({ typeHandle, {},
+                                       InternedStrings::lookup(stateKey),
+                                       stateKey },
+                                     nullptr)
+                : getCurrentState(QString::fromLatin1(EventT::matrixTypeId()),
+                                  stateKey);
+        if (!evt)
+            evt = getStubState(EventT::matrixTypeId(), stateKey);
         Q_ASSERT(evt->type() == EventT::typeId()
                  && evt->matrixType() == EventT::matrixTypeId());
         return static_cast<const EventT*>(evt);
     }
 
+    static const StateEventBase* getStubState(const QString& matrixType,
+                                              const QString& stateKey)
+    {
+        const auto stubKey = qMakePair(matrixType, stateKey);
+        auto stubIt = stubbedState.find(stubKey);
+        if (stubIt == stubbedState.end()) {
+            // In the absence of a real event, make a stub as-if an event
+            // with empty content has been received. Event classes should be
+            // prepared for empty/invalid/malicious content anyway.
+            // Queries for arbitrary keys should not fill InternedStrings.
+            const InternedStrings::LookupOnlyScope _;
+            stubIt = stubbedState
+                         .emplace(stubKey,
+                                  loadStateEvent(matrixType, {}, stateKey))
+                         .first;
+            qCDebug(STATE) << "A new stub event created for key {"
+                           << matrixType << stateKey << "}";
+        }
+        const auto* evt = stubIt->second.get();
+        Q_ASSERT(evt && evt->matrixType() == matrixType
+                 && evt->stateKey() == stateKey);
+        return evt;
+    }
+
     bool isEventNotable(const TimelineItem& ti) const
     {
         return !ti->isRedacted() && ti->senderId() != connection->userId()
                && is<RoomMessageEvent>(*ti);
     }
+    /// The number of notable events in [from, to) of the timeline
+    int countNotableEvents(Timeline::const_iterator from,
+                           Timeline::const_iterator to) const
+    {
+        using index_t = TimelineItem::index_t;
+        const auto frontIndex = timeline.empty() ? 0 : timeline.front().index();
+        return notableEvents.count(
+            frontIndex + index_t(from - timeline.cbegin()),
+            frontIndex + index_t(to - timeline.cbegin()));
+    }
 
     template <typename EventArrayT>
     Changes updateStateFrom(EventArrayT&& events)
@@ -252,7 +473,7 @@ public:
                 // Update baseState afterwards to make sure that the old state
                 // is valid and usable inside processStateEvent
                 changes |= q->processStateEvent(evt);
-                baseState[{ evt.matrixType(), evt.stateKey() }] = move(eptr);
+                baseState[evt.stateEventKey()] = move(eptr);
             }
             if (events.size() > 9 || et.nsecsElapsed() >= profilerMinNsecs())
                 qCDebug(PROFILER)
@@ -282,7 +503,34 @@ public:
     void dropDuplicateEvents(RoomEvents& events) const;
 
     Changes setLastReadEvent(User* u, QString eventId);
+    using ReadReceiptMoves = std::vector<std::pair<User*, QString>>;
+    /// Move the read receipts of several users at once
+    /** Each user may only occur once in \p moves. The users are taken
+     * off their previous events with a single pass over each of them.
+     */
+    Changes setLastReadEvents(ReadReceiptMoves&& moves);
+    /// Index the receipts waiting for an event that got into the timeline
+    void attachReadReceipts(const QString& eventId,
+                            TimelineItem::index_t index);
+    /// Key the receipts at the event by its id as it's evicted
+    void detachReadReceipts(const TimelineItem& ti);
+    /// Whether the local read marker is at an evicted event
+    /** The unread messages are still counted from it, even though
+     * readMarker() returns timelineEdge().
+     */
+    bool readMarkerEvicted() const
+    {
+        return readReceipts.value(q->localUser()).evicted;
+    }
     void updateUnreadCount(rev_iter_t from, rev_iter_t to);
+    /// The position past the read marker for \p u promoted over the user's
+    /// own messages, as a direct iterator
+    Timeline::const_iterator eagerReadMarker(const User* u,
+                                             rev_iter_t newMarker) const;
+    QString eagerReadEventId(const User* u, rev_iter_t newMarker) const
+    {
+        return (*(eagerReadMarker(u, newMarker) - 1))->id();
+    }
     Changes promoteReadMarker(User* u, rev_iter_t newMarker, bool force = false);
 
     Changes markMessagesAsRead(rev_iter_t upToMarker);
@@ -298,6 +546,9 @@ public:
     }
 
     RoomEvent* addAsPending(RoomEventPtr&& event);
+    /// The position of the event in unsyncedEvents, or -1 if it's not there
+    int findUnsyncedEvent(const QString& txnId) const;
+    void eraseUnsyncedEvent(int index);
 
     QString doSendEvent(const RoomEvent* pEvent);
     void onEventSendingFailure(const QString& txnId, BaseJob* call = nullptr);
@@ -339,6 +590,8 @@ public:
     void setTags(TagsMap newTags);
 
     QJsonObject toJson() const;
+    QJsonObject toIndexJson() const;
+    QJsonObject unreadNotificationsJson() const;
 
 private:
     using users_shortlist_t = std::array<User*, 3>;
@@ -349,7 +602,7 @@ private:
     bool isLocalUser(const User* u) const { return u == q->localUser(); }
 };
 
-decltype(Room::Private::baseState) Room::Private::stubbedState {};
+decltype(Room::Private::stubbedState) Room::Private::stubbedState {};
 
 Room::Room(Connection* connection, QString id, JoinState initialJoinState)
     : QObject(connection), d(new Private(connection, id, initialJoinState))
@@ -510,21 +763,106 @@ void Room::setJoinState(JoinState state)
 
 Room::Changes Room::Private::setLastReadEvent(User* u, QString eventId)
 {
-    auto& storedId = lastReadEventIds[u];
-    if (storedId == eventId)
-        return Change::NoChange;
-    eventIdReadUsers.remove(storedId, u);
-    eventIdReadUsers.insert(eventId, u);
-    swap(storedId, eventId);
-    emit q->lastReadEventChanged(u);
-    emit q->readMarkerForUserMoved(u, eventId, storedId);
-    if (isLocalUser(u)) {
-        if (storedId != serverReadMarker)
-            connection->callApi<PostReadMarkersJob>(id, storedId);
-        emit q->readMarkerMoved(eventId, storedId);
-        return Change::ReadMarkerChange;
+    return setLastReadEvents({ { u, move(eventId) } });
+}
+
+template <typename KeyT>
+static void removeReadUsers(QHash<KeyT, QList<User*>>& readUsers,
+                            const KeyT& key, const QSet<User*>& users)
+{
+    const auto it = readUsers.find(key);
+    if (it == readUsers.end())
+        return;
+    it->erase(std::remove_if(it->begin(), it->end(),
+                             [&users](User* u) { return users.contains(u); }),
+              it->end());
+    if (it->isEmpty())
+        readUsers.erase(it);
+}
+
+Room::Changes Room::Private::setLastReadEvents(ReadReceiptMoves&& moves)
+{
+    QHash<TimelineItem::index_t, QSet<User*>> usersOffIndices;
+    QHash<QString, QSet<User*>> usersOffMissingEvents;
+    const auto movesEnd = std::remove_if(
+        moves.begin(), moves.end(), [this, &usersOffIndices,
+                                     &usersOffMissingEvents](const auto& m) {
+            const auto it = readReceipts.constFind(m.first);
+            if (it == readReceipts.cend())
+                return m.second.isEmpty();
+            if (it->eventId == m.second)
+                return true; // Nothing to move
+            if (it->inTimeline)
+                usersOffIndices[it->index].insert(m.first);
+            else
+                usersOffMissingEvents[it->eventId].insert(m.first);
+            return false;
+        });
+    moves.erase(movesEnd, moves.end());
+    for (auto it = usersOffIndices.cbegin(); it != usersOffIndices.cend(); ++it)
+        removeReadUsers(readUsersAtIndex, it.key(), *it);
+    for (auto it = usersOffMissingEvents.cbegin();
+         it != usersOffMissingEvents.cend(); ++it)
+        removeReadUsers(readUsersAtMissingEvent, it.key(), *it);
+
+    for (auto& [u, eventId] : moves) {
+        auto& receipt = readReceipts[u];
+        swap(receipt.eventId, eventId); // eventId gets the previous one
+        receipt.evicted = false;
+        const auto indexIt = eventsIndex.constFind(receipt.eventId);
+        receipt.inTimeline = indexIt != eventsIndex.cend();
+        if (receipt.inTimeline) {
+            receipt.index = *indexIt;
+            readUsersAtIndex[receipt.index].append(u);
+        } else
+            readUsersAtMissingEvent[receipt.eventId].append(u);
+    }
+
+    // Signal handlers may move the receipts again, so the signals are only
+    // emitted once the index is complete
+    Changes changes = Change::NoChange;
+    for (const auto& [u, prevEventId] : moves) {
+        const auto newEventId = readReceipts.value(u).eventId;
+        emit q->lastReadEventChanged(u);
+        emit q->readMarkerForUserMoved(u, prevEventId, newEventId);
+        if (isLocalUser(u)) {
+            if (newEventId != serverReadMarker)
+                connection->callApi<PostReadMarkersJob>(id, newEventId);
+            emit q->readMarkerMoved(prevEventId, newEventId);
+            changes |= Change::ReadMarkerChange;
+        }
     }
-    return Change::NoChange;
+    return changes;
+}
+
+void Room::Private::attachReadReceipts(const QString& eventId,
+                                       TimelineItem::index_t index)
+{
+    const auto it = readUsersAtMissingEvent.find(eventId);
+    if (it == readUsersAtMissingEvent.end())
+        return;
+    for (auto* u : qAsConst(*it)) {
+        auto& receipt = readReceipts[u];
+        receipt.inTimeline = true;
+        receipt.evicted = false;
+        receipt.index = index;
+    }
+    readUsersAtIndex[index] += *it;
+    readUsersAtMissingEvent.erase(it);
+}
+
+void Room::Private::detachReadReceipts(const TimelineItem& ti)
+{
+    const auto it = readUsersAtIndex.find(ti.index());
+    if (it == readUsersAtIndex.end())
+        return;
+    for (auto* u : qAsConst(*it)) {
+        auto& receipt = readReceipts[u];
+        receipt.inTimeline = false;
+        receipt.evicted = true;
+    }
+    readUsersAtMissingEvent[ti->id()] += *it;
+    readUsersAtIndex.erase(it);
 }
 
 void Room::Private::updateUnreadCount(rev_iter_t from, rev_iter_t to)
@@ -546,12 +884,8 @@ void Room::Private::updateUnreadCount(rev_iter_t from, rev_iter_t to)
 
     Q_ASSERT(to <= readMarker);
 
-    QElapsedTimer et;
-    et.start();
-    const auto newUnreadMessages =
-        count_if(from, to, std::bind(&Room::Private::isEventNotable, this, _1));
-    if (et.nsecsElapsed() > profilerMinNsecs() / 10)
-        qCDebug(PROFILER) << "Counting gained unread messages took" << et;
+    // Reverse iterators cover [to.base(), from.base()) of the timeline
+    const auto newUnreadMessages = countNotableEvents(to.base(), from.base());
 
     if (newUnreadMessages > 0) {
         // See https://github.com/quotient-im/libQuotient/wiki/unread_count
@@ -562,6 +896,7 @@ void Room::Private::updateUnreadCount(rev_iter_t from, rev_iter_t to)
         qCDebug(MESSAGES) << "Room" << q->objectName() << "has gained"
                           << newUnreadMessages << "unread message(s),"
                           << (q->readMarker() == timeline.crend()
+                                      && !readMarkerEvicted()
                                   ? "in total at least"
                                   : "in total")
                           << unreadMessages << "unread message(s)";
@@ -569,6 +904,17 @@ void Room::Private::updateUnreadCount(rev_iter_t from, rev_iter_t to)
     }
 }
 
+Room::Timeline::const_iterator
+Room::Private::eagerReadMarker(const User* u, rev_iter_t newMarker) const
+{
+    // Try to auto-promote the read marker over the user's own messages
+    // (switch to direct iterators for that).
+    return find_if(newMarker.base(), timeline.cend(),
+                   [u](const TimelineItem& ti) {
+                       return ti->senderId() != u->id();
+                   });
+}
+
 Room::Changes Room::Private::promoteReadMarker(User* u, rev_iter_t newMarker,
                                                bool force)
 {
@@ -582,23 +928,11 @@ Room::Changes Room::Private::promoteReadMarker(User* u, rev_iter_t newMarker,
 
     Q_ASSERT(newMarker < timeline.crend());
 
-    // Try to auto-promote the read marker over the user's own messages
-    // (switch to direct iterators for that).
-    auto eagerMarker =
-        find_if(newMarker.base(), timeline.cend(), [=](const TimelineItem& ti) {
-            return ti->senderId() != u->id();
-        });
-
+    const auto eagerMarker = eagerReadMarker(u, newMarker);
     auto changes = setLastReadEvent(u, (*(eagerMarker - 1))->id());
     if (isLocalUser(u)) {
         const auto oldUnreadCount = unreadMessages;
-        QElapsedTimer et;
-        et.start();
-        unreadMessages =
-            int(count_if(eagerMarker, timeline.cend(),
-                         std::bind(&Room::Private::isEventNotable, this, _1)));
-        if (et.nsecsElapsed() > profilerMinNsecs() / 10)
-            qCDebug(PROFILER) << "Recounting unread messages took" << et;
+        unreadMessages = countNotableEvents(eagerMarker, timeline.cend());
 
         // See https://github.com/quotient-im/libQuotient/wiki/unread_count
         if (unreadMessages == 0)
@@ -713,19 +1047,16 @@ Room::rev_iter_t Room::findInTimeline(const QString& evtId) const
 
 Room::PendingEvents::iterator Room::findPendingEvent(const QString& txnId)
 {
-    return std::find_if(d->unsyncedEvents.begin(), d->unsyncedEvents.end(),
-                        [txnId](const auto& item) {
-                            return item->transactionId() == txnId;
-                        });
+    const auto idx = d->findUnsyncedEvent(txnId);
+    return idx == -1 ? d->unsyncedEvents.end() : d->unsyncedEvents.begin() + idx;
 }
 
 Room::PendingEvents::const_iterator
 Room::findPendingEvent(const QString& txnId) const
 {
-    return std::find_if(d->unsyncedEvents.cbegin(), d->unsyncedEvents.cend(),
-                        [txnId](const auto& item) {
-                            return item->transactionId() == txnId;
-                        });
+    const auto idx = d->findUnsyncedEvent(txnId);
+    return idx == -1 ? d->unsyncedEvents.cend()
+                     : d->unsyncedEvents.cbegin() + idx;
 }
 
 const Room::RelatedEvents Room::relatedEvents(const QString& evtId,
@@ -778,7 +1109,19 @@ void Room::setDisplayed(bool displayed)
         resetHighlightCount();
         resetNotificationCount();
         d->getAllMembers();
-    }
+        if (d->timeline.size() < 20)
+            d->loadFromTimelineStore(20);
+        d->requestGapFill();
+    } else
+        d->evictOldEvents();
+}
+
+int Room::timelineLimit() const { return d->timelineLimit; }
+
+void Room::setTimelineLimit(int limit)
+{
+    d->timelineLimit = limit;
+    d->evictOldEvents();
 }
 
 QString Room::firstDisplayedEventId() const { return d->firstDisplayedEventId; }
@@ -828,19 +1171,25 @@ void Room::setLastDisplayedEvent(TimelineItem::index_t index)
 Room::rev_iter_t Room::readMarker(const User* user) const
 {
     Q_ASSERT(user);
-    return findInTimeline(d->lastReadEventIds.value(user));
+    const auto it = d->readReceipts.constFind(user);
+    return it != d->readReceipts.cend() && it->inTimeline
+               ? findInTimeline(it->index)
+               : timelineEdge();
 }
 
 Room::rev_iter_t Room::readMarker() const { return readMarker(localUser()); }
 
 QString Room::readMarkerEventId() const
 {
-    return d->lastReadEventIds.value(localUser());
+    return d->readReceipts.value(localUser()).eventId;
 }
 
 QList<User*> Room::usersAtEventId(const QString& eventId)
 {
-    return d->eventIdReadUsers.values(eventId);
+    if (const auto it = d->eventsIndex.constFind(eventId);
+        it != d->eventsIndex.cend())
+        return d->readUsersAtIndex.value(*it);
+    return d->readUsersAtMissingEvent.value(eventId);
 }
 
 int Room::notificationCount() const { return d->notificationCount; }
@@ -1148,7 +1497,7 @@ bool Room::usesEncryption() const
 const StateEventBase* Room::getCurrentState(const QString& evtType,
                                             const QString& stateKey) const
 {
-    return d->getCurrentState({ evtType, stateKey });
+    return d->getCurrentState(evtType, stateKey);
 }
 
 RoomEventPtr Room::decryptMessage(EncryptedEvent* encryptedEvent)
@@ -1333,15 +1682,42 @@ Room::Private::moveEventsToTimeline(RoomEventsRange events,
             !eventsIndex.contains(eId), __FUNCTION__,
             makeErrorStr(*e, "Event is already in the timeline; "
                              "incoming events were not properly deduplicated"));
-        if (placement == Older)
+        if (placement == Older) {
             timeline.emplace_front(move(e), --index);
-        else
+            notableEvents.set(index, isEventNotable(timeline.front()));
+        } else {
             timeline.emplace_back(move(e), ++index);
+            notableEvents.set(index, isEventNotable(timeline.back()));
+        }
         eventsIndex.insert(eId, index);
+        attachReadReceipts(eId, index);
         Q_ASSERT(q->findInTimeline(eId)->event()->id() == eId);
     }
     const auto insertedSize = (index - baseIndex) * placement;
     Q_ASSERT(insertedSize == int(events.size()));
+    if (auto* store = restoringTimeline ? nullptr : persistentTimeline()) {
+        // Same as above, older events go from the newest to the oldest;
+        // they go before the former oldest event, unless the store has
+        // more events before it
+        if (placement == Older) {
+            const auto oldestIt = timeline.cbegin() + insertedSize;
+            auto beforeId = oldestIt == timeline.cend() ? QString()
+                                                        : (*oldestIt)->id();
+            const auto atStoreStart = beforeId == store->oldestEventId();
+            for (auto it = oldestIt; it != timeline.cbegin();) {
+                const auto& evt = **--it;
+                if (beforeId.isEmpty() || atStoreStart)
+                    store->addOlderEvent(evt);
+                else
+                    store->insertEventBefore(beforeId, evt);
+                beforeId = evt.id();
+            }
+        } else
+            for (auto it = timeline.cend() - insertedSize;
+                 it != timeline.cend(); ++it)
+                store->addNewerEvent(**it);
+        store->flush();
+    }
     return insertedSize;
 }
 
@@ -1387,8 +1763,14 @@ QString Room::roomMembername(const QString& userId) const
 
 void Room::updateData(SyncRoomData&& data, bool fromCache)
 {
-    if (d->prevBatch.isEmpty())
+    if (d->prevBatch.isEmpty()) {
         d->prevBatch = data.timelinePrevBatch;
+        // The token only applies to the store if the store starts with
+        // the events of this batch
+        auto* store = d->persistentTimeline();
+        if (store && !data.timelinePrevBatch.isEmpty() && store->isEmpty())
+            store->setPrevBatch(data.timelinePrevBatch);
+    }
     setJoinState(data.joinState);
 
     Changes roomChanges = Change::NoChange;
@@ -1401,7 +1783,25 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
 
     if (!data.timeline.empty()) {
         et.restart();
+        const auto nextIndex =
+            d->timeline.empty() ? 0 : maxTimelineIndex() + 1;
+        const auto hadEvents = !d->timeline.empty();
         roomChanges |= d->addNewMessageEvents(move(data.timeline));
+        if (!data.timelinePrevBatch.isEmpty() && isValidIndex(nextIndex)) {
+            d->paginationTokens.emplace(nextIndex, data.timelinePrevBatch);
+            // The server skipped some events; remember where. Without
+            // earlier events in memory, the gap is still there in the store
+            // (e.g., after a restart) if it has events before this batch.
+            const auto& firstId = (*findInTimeline(nextIndex))->id();
+            auto* store = d->persistentTimeline();
+            if (data.timelineLimited && hadEvents)
+                d->setGapBefore(firstId, data.timelinePrevBatch);
+            else if (data.timelineLimited && store
+                     && store->oldestEventId() != firstId) {
+                store->setGapBefore(firstId, data.timelinePrevBatch);
+                store->flush();
+            }
+        }
         if (data.timeline.size() > 9 || et.nsecsElapsed() >= profilerMinNsecs())
             qCDebug(PROFILER)
                 << "*** Room::addNewMessageEvents():" << data.timeline.size()
@@ -1445,6 +1845,9 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
         if (!fromCache)
             connection()->saveRoomState(this);
     }
+    d->evictOldEvents();
+    if (!fromCache)
+        d->requestGapFill();
 }
 
 RoomEvent* Room::Private::addAsPending(RoomEventPtr&& event)
@@ -1457,11 +1860,31 @@ RoomEvent* Room::Private::addAsPending(RoomEventPtr&& event)
         event->setSender(connection->userId());
     auto* pEvent = rawPtr(event);
     emit q->pendingEventAboutToAdd(pEvent);
+    unsyncedTxnIndex.insert(pEvent->transactionId(), nextUnsyncedKey);
+    unsyncedKeys.push_back(nextUnsyncedKey++);
     unsyncedEvents.emplace_back(move(event));
     emit q->pendingEventAdded();
     return pEvent;
 }
 
+int Room::Private::findUnsyncedEvent(const QString& txnId) const
+{
+    const auto keyIt = unsyncedTxnIndex.constFind(txnId);
+    if (keyIt == unsyncedTxnIndex.cend())
+        return -1;
+    const auto it =
+        std::lower_bound(unsyncedKeys.cbegin(), unsyncedKeys.cend(), *keyIt);
+    Q_ASSERT(it != unsyncedKeys.cend() && *it == *keyIt);
+    return int(it - unsyncedKeys.cbegin());
+}
+
+void Room::Private::eraseUnsyncedEvent(int index)
+{
+    unsyncedTxnIndex.remove(unsyncedEvents[size_t(index)]->transactionId());
+    unsyncedEvents.erase(unsyncedEvents.begin() + index);
+    unsyncedKeys.erase(unsyncedKeys.begin() + index);
+}
+
 QString Room::Private::sendEvent(RoomEventPtr&& event)
 {
     if (q->usesEncryption()) {
@@ -1567,10 +1990,7 @@ QString Room::retryMessage(const QString& txnId)
 
 void Room::discardMessage(const QString& txnId)
 {
-    auto it = std::find_if(d->unsyncedEvents.begin(), d->unsyncedEvents.end(),
-                           [txnId](const auto& evt) {
-                               return evt->transactionId() == txnId;
-                           });
+    const auto it = findPendingEvent(txnId);
     Q_ASSERT(it != d->unsyncedEvents.end());
     qCDebug(EVENTS) << "Discarding transaction" << txnId;
     const auto& transferIt = d->fileTransfers.find(txnId);
@@ -1586,8 +2006,9 @@ void Room::discardMessage(const QString& txnId)
                 << "has been uploaded but the message was discarded";
         }
     }
-    emit pendingEventAboutToDiscard(int(it - d->unsyncedEvents.begin()));
-    d->unsyncedEvents.erase(it);
+    const auto idx = int(it - d->unsyncedEvents.begin());
+    emit pendingEventAboutToDiscard(idx);
+    d->eraseUnsyncedEvent(idx);
     emit pendingEventDiscarded();
 }
 
@@ -1660,7 +2081,7 @@ QString Room::postFile(const QString& plainText, const QUrl& localPath,
                         const auto idx = int(it - d->unsyncedEvents.begin());
                         emit pendingEventAboutToDiscard(idx);
                         // See #286 on why iterator may not be valid here.
-                        d->unsyncedEvents.erase(d->unsyncedEvents.begin() + idx);
+                        d->eraseUnsyncedEvent(idx);
                         emit pendingEventDiscarded();
                     }
                 }
@@ -1779,22 +2200,629 @@ void Room::hangupCall(const QString& callId)
 
 void Room::getPreviousContent(int limit) { d->getPreviousContent(limit); }
 
+static auto findEventIn(RoomEvents& events, const QString& eventId)
+{
+    return std::find_if(events.begin(), events.end(),
+                        [&eventId](const RoomEventPtr& e) {
+                            return e->id() == eventId;
+                        });
+}
+
 void Room::Private::getPreviousContent(int limit)
 {
     if (isJobRunning(eventsHistoryJob))
         return;
+    // Stored history comes first
+    if (loadFromTimelineStore(limit))
+        return;
 
     eventsHistoryJob =
         connection->callApi<GetRoomEventsJob>(id, prevBatch, "b", "", limit);
     emit q->eventsHistoryJobChanged();
     connect(eventsHistoryJob, &BaseJob::success, q, [=] {
         prevBatch = eventsHistoryJob->end();
-        addHistoricalMessageEvents(eventsHistoryJob->chunk());
+        auto events = eventsHistoryJob->chunk();
+        // If the history has reached a detached fragment, the rest of it
+        // is already there
+        QString fragmentEventId;
+        for (auto it = events.begin(); it != events.end(); ++it) {
+            const auto f = findFragment((*it)->id());
+            if (f == fragments.end())
+                continue;
+            fragmentEventId = (*it)->id();
+            events.erase(it, events.end());
+            prevBatch = f->prevBatch;
+            auto fragmentEvents = takeFragmentEvents(f);
+            const auto meetIt = findEventIn(fragmentEvents, fragmentEventId);
+            for (auto fIt = std::make_reverse_iterator(meetIt + 1);
+                 fIt != fragmentEvents.rend(); ++fIt)
+                events.emplace_back(move(*fIt));
+            break;
+        }
+        if (auto* store = persistentTimeline())
+            store->setPrevBatch(prevBatch);
+        addHistoricalMessageEvents(move(events));
+        if (!timeline.empty())
+            paginationTokens[timeline.front().index()] = prevBatch;
+        if (!fragmentEventId.isEmpty())
+            emit q->fragmentMerged(fragmentEventId);
     });
     connect(eventsHistoryJob, &QObject::destroyed, q,
             &Room::eventsHistoryJobChanged);
 }
 
+TimelineStore* Room::Private::persistentTimeline()
+{
+    if (!timelineStore && !timelineStoreDropped && connection->cacheState()
+        && connection->cacheTimeline() && joinState != JoinState::Invite)
+        timelineStore = std::make_unique<TimelineStore>(
+            connection->stateCacheDir().filePath(
+                TimelineStore::fileNameForRoom(id)));
+    return timelineStore.get();
+}
+
+bool Room::Private::loadFromTimelineStore(int limit)
+{
+    auto* store = persistentTimeline();
+    if (!store || store->isEmpty())
+        return false;
+
+    QElapsedTimer et;
+    et.start();
+    // If the oldest loaded event is not in the store, the store can't tell
+    // what precedes it
+    auto events = store->loadEventsBefore(
+        timeline.empty() ? QString() : timeline.front()->id(), limit);
+    if (events.empty())
+        return false;
+    const auto oldestId = events.back()->id();
+    const auto reachedStoreStart = oldestId == store->oldestEventId();
+    const auto timelineSize = timeline.size();
+    // The gaps recorded in the store before the loaded events and before
+    // the formerly oldest one are in the middle of the timeline now
+    QStringList gapEventIds;
+    if (!timeline.empty())
+        gapEventIds << timeline.front()->id();
+    for (const auto& e : events)
+        if (e->id() != oldestId)
+            gapEventIds << e->id();
+    restoringTimeline = true;
+    addHistoricalMessageEvents(move(events));
+    restoringTimeline = false;
+    for (const auto& eventId : gapEventIds)
+        if (const auto token = store->gapBefore(eventId); !token.isEmpty()) {
+            gapTokens.insert(eventId, token);
+            paginationTokens[eventsIndex.value(eventId)] = token;
+        }
+    // The one before the oldest event is where back-pagination starts
+    if (reachedStoreStart)
+        prevBatch = store->prevBatch();
+    else if (const auto token = store->gapBefore(oldestId); !token.isEmpty())
+        prevBatch = token;
+    qCDebug(PROFILER) << "Restored" << timeline.size() - timelineSize
+                      << "event(s) of" << displayname << "from the store in"
+                      << et;
+    return timeline.size() > timelineSize;
+}
+
+void Room::Private::evictOldEvents()
+{
+    if (timelineLimit <= 0 || displayed
+        || timeline.size() <= size_t(timelineLimit))
+        return;
+
+    // The new oldest event has to be reloadable: either from the store
+    // or from the server, using the token to paginate back from it
+    // The read marker may go too: the unread messages are counted in
+    // unreadMessages, and the marker is then known to be older than all
+    // the events left (see readMarkerEvicted())
+    const auto frontIndex = timeline.front().index();
+    auto newFrontIndex = q->maxTimelineIndex() - timelineLimit + 1;
+    auto* store = persistentTimeline();
+    if (!store || !store->contains((*q->findInTimeline(newFrontIndex))->id())) {
+        auto tokenIt = paginationTokens.upper_bound(newFrontIndex);
+        if (tokenIt == paginationTokens.begin())
+            return;
+        newFrontIndex = (--tokenIt)->first;
+    }
+    if (newFrontIndex <= frontIndex)
+        return;
+
+    emit q->aboutToEvictMessages(frontIndex, newFrontIndex - 1);
+    detachEventsBefore(newFrontIndex);
+    if (const auto tokenIt = paginationTokens.find(newFrontIndex);
+        tokenIt != paginationTokens.end())
+        prevBatch = tokenIt->second;
+    // A gap at the new oldest event is just where back-pagination starts
+    gapTokens.remove(timeline.front()->id());
+    paginationTokens.erase(paginationTokens.begin(),
+                           paginationTokens.lower_bound(newFrontIndex));
+    qCDebug(MESSAGES) << "Room" << displayname << "evicted"
+                      << newFrontIndex - frontIndex << "old event(s)";
+    emit q->evictedMessages(frontIndex, newFrontIndex - 1);
+}
+
+void Room::Private::detachEventsBefore(TimelineItem::index_t newFrontIndex)
+{
+    while (!timeline.empty() && timeline.front().index() < newFrontIndex) {
+        auto& ti = timeline.front();
+        eventsIndex.remove(ti->id());
+        detachReadReceipts(ti);
+        if (const auto* reaction = ti.viewAs<ReactionEvent>()) {
+            const auto& relation = reaction->relation();
+            const auto relIt =
+                relations.find({ relation.eventId, relation.type });
+            if (relIt != relations.end()) {
+                relIt->removeOne(reaction);
+                if (relIt->isEmpty())
+                    relations.erase(relIt);
+            }
+        }
+        gapTokens.remove(ti->id());
+        // The events relating to this one are linked again if it's
+        // reloaded (see addHistoricalMessageEvents())
+        for (auto relType : { EventRelation::Annotation(),
+                              EventRelation::Reply(),
+                              EventRelation::Replacement() })
+            if (relations.remove({ ti->id(), relType }) > 0)
+                relatedEventsEvicted = true;
+        if (ti->id() == firstDisplayedEventId)
+            q->setFirstDisplayedEventId({});
+        if (ti->id() == lastDisplayedEventId)
+            q->setLastDisplayedEventId({});
+        if (ti->isStateEvent()) {
+            // The timeline owns the events the current state points to;
+            // keep the event if it's still current (along with its arena
+            // chunk, see EventArenaScope)
+            const auto evtKey = ti->stateEventKey();
+            if (currentState.value(evtKey) == ti.event())
+                baseState[evtKey].reset(static_cast<StateEventBase*>(
+                    ti.replaceEvent({}).release()));
+        }
+        timeline.pop_front();
+    }
+}
+
+void Room::Private::setGapBefore(const QString& eventId, const QString& token)
+{
+    if (token.isEmpty())
+        gapTokens.remove(eventId);
+    else
+        gapTokens.insert(eventId, token);
+    if (auto* store = persistentTimeline()) {
+        store->setGapBefore(eventId, token);
+        store->flush();
+    }
+}
+
+void Room::Private::requestGapFill()
+{
+    if (!gapTokens.empty()
+        && (displayed || q->isFavourite() || highlightCount > 0))
+        connection->queueGapFill(q);
+}
+
+GetRoomEventsJob* Room::fillNextGap()
+{
+    if (isJobRunning(d->gapFillJob))
+        return nullptr;
+    if (!d->gapTokens.contains(d->gapFillEventId)) {
+        // Start with the newest gap, the closest to what the user sees
+        d->gapFillEventId.clear();
+        for (auto it = d->gapTokens.cbegin(); it != d->gapTokens.cend(); ++it)
+            if (d->gapFillEventId.isEmpty()
+                || d->eventsIndex.value(it.key())
+                       > d->eventsIndex.value(d->gapFillEventId))
+                d->gapFillEventId = it.key();
+        if (d->gapFillEventId.isEmpty())
+            return nullptr;
+        d->gapFillToken = d->gapTokens.value(d->gapFillEventId);
+        d->gapFillEvents.clear();
+        d->gapFillPages = 0;
+    }
+    auto* job = connection()->callApi<GetRoomEventsJob>(
+        BackgroundRequest, id(), d->gapFillToken, "b", "", 50);
+    d->gapFillJob = job;
+    connect(job, &BaseJob::success, this,
+            [this, job] { d->onGapFillPage(job); });
+    return job;
+}
+
+void Room::Private::onGapFillPage(GetRoomEventsJob* job)
+{
+    if (!gapTokens.contains(gapFillEventId))
+        return; // The gap has been evicted in the meantime
+    if (!connection->timelineInsertion())
+        return; // Disabled in the meantime; refilled from the same token
+
+    auto events = job->chunk();
+    // The gap is closed when the events reach the part of the timeline
+    // before the gap, or the beginning of the room
+    auto gapClosed = events.empty();
+    for (auto& e : events) {
+        if (eventsIndex.contains(e->id())) {
+            gapClosed = true;
+            break;
+        }
+        gapFillEvents.emplace_back(move(e));
+    }
+    gapFillToken = job->end();
+    // Don't keep too much out of the timeline if the gap is large; fill it
+    // step by step instead
+    static constexpr auto MaxGapFillPages = 5;
+    if (gapClosed || ++gapFillPages >= MaxGapFillPages)
+        insertGapEvents(gapClosed);
+    else
+        connection->queueGapFill(q);
+}
+
+void Room::Private::insertGapEvents(bool gapClosed)
+{
+    QElapsedTimer et;
+    et.start();
+    const auto gapIndex = eventsIndex.value(gapFillEventId);
+    const auto gapEventId = std::exchange(gapFillEventId, {});
+    gapFillPages = 0;
+    auto events = std::exchange(gapFillEvents, {});
+    if (events.empty()) {
+        setGapBefore(gapEventId, {});
+        return;
+    }
+
+    const auto insertedSize = events.size();
+    const auto oldestId = events.back()->id();
+    insertEventsBefore(gapIndex, move(events));
+    setGapBefore(gapEventId, {});
+    if (!gapClosed) // What remains of the gap is before the fetched events
+        setGapBefore(oldestId, gapFillToken);
+    qCDebug(PROFILER) << "Filled" << insertedSize << "event(s) in a gap of"
+                      << displayname << (gapClosed ? "" : "(partially)")
+                      << "in" << et;
+    requestGapFill();
+}
+
+void Room::Private::insertEventsBefore(TimelineItem::index_t beforeIndex,
+                                       RoomEvents&& events)
+{
+    dropDuplicateEvents(events);
+    if (events.empty())
+        return;
+
+    for (const auto& eptr : events) {
+        const auto& e = *eptr;
+        if (e.isStateEvent() && !currentState.contains(e.stateEventKey()))
+            q->processStateEvent(e);
+    }
+
+    const auto size = int(events.size());
+    const auto pos = beforeIndex - timeline.front().index();
+    // Only the events on the shorter side of the insertion point are
+    // renumbered: either the newer ones move up or the older ones move down
+    const auto shiftNewer = int(timeline.size()) - pos < pos;
+    const auto shift = shiftNewer ? size : -size;
+    const auto isShifted = [shiftNewer, beforeIndex](TimelineItem::index_t i) {
+        return shiftNewer ? i >= beforeIndex : i < beforeIndex;
+    };
+    const auto firstIndex = shiftNewer ? beforeIndex : beforeIndex - size;
+    emit q->aboutToInsertMessages(events, beforeIndex);
+    // The renumbered events keep their places in the deque
+    for (auto it = shiftNewer ? timeline.begin() + pos : timeline.begin();
+         it != (shiftNewer ? timeline.end() : timeline.begin() + pos); ++it) {
+        const auto newIndex = it->index() + shift;
+        auto evt = it->replaceEvent({});
+        eventsIndex.insert(evt->id(), newIndex);
+        *it = TimelineItem(move(evt), newIndex);
+    }
+    std::vector<TimelineItem> items;
+    items.reserve(events.size());
+    for (auto it = events.rbegin(); it != events.rend(); ++it) {
+        const auto index = firstIndex + int(items.size());
+        eventsIndex.insert((*it)->id(), index);
+        items.emplace_back(move(*it), index);
+    }
+    timeline.insert(timeline.begin() + pos,
+                    std::make_move_iterator(items.begin()),
+                    std::make_move_iterator(items.end()));
+    for (auto it = shiftNewer ? timeline.cbegin() + pos : timeline.cbegin();
+         it != (shiftNewer ? timeline.cend() : timeline.cbegin() + pos + size);
+         ++it)
+        notableEvents.set(it->index(), isEventNotable(*it));
+    {
+        const auto tokensBegin = shiftNewer
+                                     ? paginationTokens.lower_bound(beforeIndex)
+                                     : paginationTokens.begin();
+        const auto tokensEnd = shiftNewer
+                                   ? paginationTokens.end()
+                                   : paginationTokens.lower_bound(beforeIndex);
+        std::map<TimelineItem::index_t, QString> shiftedTokens;
+        for (auto it = tokensBegin; it != tokensEnd; ++it)
+            shiftedTokens.emplace(it->first + shift, move(it->second));
+        paginationTokens.erase(tokensBegin, tokensEnd);
+        paginationTokens.insert(shiftedTokens.begin(), shiftedTokens.end());
+    }
+    // The read receipts at the renumbered events are shifted along with them;
+    // then the receipts waiting for the inserted events find their places
+    decltype(readUsersAtIndex) shiftedReadUsers;
+    shiftedReadUsers.reserve(readUsersAtIndex.size());
+    for (auto it = readUsersAtIndex.begin(); it != readUsersAtIndex.end();
+         ++it) {
+        const auto index = isShifted(it.key()) ? it.key() + shift : it.key();
+        if (index != it.key())
+            for (auto* u : qAsConst(*it))
+                readReceipts[u].index = index;
+        shiftedReadUsers.insert(index, move(*it));
+    }
+    readUsersAtIndex = move(shiftedReadUsers);
+    for (auto index = firstIndex; index < firstIndex + size; ++index)
+        attachReadReceipts((*q->findInTimeline(index))->id(), index);
+
+    const auto from = q->findInTimeline(firstIndex + size - 1);
+    const auto to = from + size;
+    for (auto it = from; it != to; ++it)
+        if (const auto* reaction = it->viewAs<ReactionEvent>()) {
+            const auto& relation = reaction->relation();
+            relations[{ relation.eventId, relation.type }] << reaction;
+            emit q->updatedEvent(relation.eventId);
+        }
+    if (to <= q->readMarker())
+        updateUnreadCount(from, to);
+    if (auto* store = persistentTimeline()) {
+        auto beforeId = (*q->findInTimeline(firstIndex + size))->id();
+        for (auto it = from; it != to; ++it) {
+            store->insertEventBefore(beforeId, **it);
+            beforeId = (*it)->id();
+        }
+        store->flush();
+    }
+    emit q->insertedMessages(firstIndex, firstIndex + size - 1);
+}
+
+Room::Private::fragments_t::iterator
+Room::Private::findFragment(const QString& eventId)
+{
+    return fragmentIndex.value(eventId, fragments.end());
+}
+
+RoomEvents Room::Private::takeFragmentEvents(fragments_t::iterator f)
+{
+    auto events = move(f->events);
+    for (const auto& e : events)
+        fragmentIndex.remove(e->id());
+    fragments.erase(f);
+    return events;
+}
+
+void Room::Private::addFragment(RoomEvents&& events, const QString& eventId,
+                                const QString& prevBatch,
+                                const QString& nextBatch)
+{
+    const auto eventIt = findEventIn(events, eventId);
+    if (eventIt == events.end()) {
+        qCWarning(MAIN) << "The context of" << eventId
+                        << "doesn't have the event itself";
+        return;
+    }
+    // Start with the event itself and grow the fragment both ways, so that
+    // overlaps with the timeline or other fragments are handled as usual
+    RoomEvents before(std::make_move_iterator(events.begin()),
+                      std::make_move_iterator(eventIt));
+    std::reverse(before.begin(), before.end());
+    RoomEvents after(std::make_move_iterator(eventIt + 1),
+                     std::make_move_iterator(events.end()));
+    fragments.push_back({});
+    auto f = std::prev(fragments.end());
+    fragmentIndex.insert(eventId, f);
+    f->events.emplace_back(move(*eventIt));
+    f->prevBatch = prevBatch; // In case the fragment is merged right away
+    f = extendFragment(f, move(after), Newer, nextBatch);
+    if (f != fragments.end()) {
+        extendFragment(f, move(before), Older, prevBatch);
+        return;
+    }
+    // The event is in the timeline now; the events before it make
+    // a fragment of their own, to be merged right before it
+    if (before.empty())
+        return;
+    const auto newestId = before.front()->id();
+    if (eventsIndex.contains(newestId) || fragmentIndex.contains(newestId))
+        return;
+    fragments.push_back({});
+    f = std::prev(fragments.end());
+    fragmentIndex.insert(newestId, f);
+    f->events.emplace_back(move(before.front()));
+    f = extendFragment(f,
+                       RoomEvents(std::make_move_iterator(before.begin() + 1),
+                                  std::make_move_iterator(before.end())),
+                       Older, prevBatch);
+    if (const auto it = eventsIndex.constFind(eventId);
+        f != fragments.end() && it != eventsIndex.cend())
+        mergeFragmentIntoTimeline(f, *it, Newer);
+}
+
+Room::Private::fragments_t::iterator
+Room::Private::extendFragment(fragments_t::iterator f, RoomEvents&& events,
+                              EventsPlacement placement, const QString& token)
+{
+    auto& edgeToken = placement == Older ? f->prevBatch : f->nextBatch;
+    for (auto& e : events) {
+        if (!e)
+            continue;
+        const auto eId = e->id();
+        const auto other = findFragment(eId);
+        if (other == f)
+            continue;
+        if (const auto it = eventsIndex.constFind(eId);
+            it != eventsIndex.cend()) {
+            // The fragment has reached the timeline
+            if (mergeFragmentIntoTimeline(f, *it, placement))
+                return fragments.end();
+            edgeToken.clear();
+            return f;
+        }
+        if (other != fragments.end()) {
+            // Two fragments meet; join them at the common event
+            const auto otherPrevBatch = other->prevBatch;
+            const auto otherNextBatch = other->nextBatch;
+            auto otherEvents = takeFragmentEvents(other);
+            auto joinBegin = otherEvents.begin();
+            auto joinEnd = otherEvents.end();
+            if (placement == Newer) {
+                joinBegin = findEventIn(otherEvents, eId);
+                f->nextBatch = otherNextBatch;
+            } else {
+                joinEnd = findEventIn(otherEvents, eId) + 1;
+                f->prevBatch = otherPrevBatch;
+            }
+            for (auto it = joinBegin; it != joinEnd; ++it)
+                fragmentIndex.insert((*it)->id(), f);
+            f->events.insert(placement == Newer ? f->events.end()
+                                                : f->events.begin(),
+                             std::make_move_iterator(joinBegin),
+                             std::make_move_iterator(joinEnd));
+            return f;
+        }
+        fragmentIndex.insert(eId, f);
+        if (placement == Newer)
+            f->events.emplace_back(move(e));
+        else
+            f->events.emplace(f->events.begin(), move(e));
+    }
+    edgeToken = token;
+    return f;
+}
+
+bool Room::Private::mergeFragmentIntoTimeline(fragments_t::iterator f,
+                                              TimelineItem::index_t meetIndex,
+                                              EventsPlacement placement)
+{
+    // Extended forward, the fragment ends right before the event it has met;
+    // extended back, it starts right after it
+    auto beforeIndex = meetIndex;
+    if (placement == Older) {
+        // Events after the newest synced one only come with the sync
+        if (meetIndex == q->maxTimelineIndex())
+            return false;
+        beforeIndex = meetIndex + 1;
+    }
+    // If the timeline has some of the fragment events already (e.g. they
+    // came with the sync after the fragment had been loaded), only those
+    // before them fit in
+    const auto knownIt = std::find_if(f->events.cbegin(), f->events.cend(),
+                                      [this](const RoomEventPtr& e) {
+                                          return eventsIndex.contains(e->id());
+                                      });
+    if (knownIt != f->events.cend())
+        beforeIndex =
+            std::min(beforeIndex, eventsIndex.value((*knownIt)->id()));
+    // Indices of the timeline events only change if the client allows it
+    if (knownIt != f->events.cbegin() && beforeIndex != timeline.front().index()
+        && !connection->timelineInsertion())
+        return false;
+    const auto newSize = knownIt - f->events.cbegin();
+    const auto fragmentPrevBatch = f->prevBatch;
+    auto events = takeFragmentEvents(f);
+    events.erase(events.begin() + newSize, events.end());
+    if (events.empty())
+        return true;
+    std::reverse(events.begin(), events.end());
+
+    if (beforeIndex == timeline.front().index()) {
+        prevBatch = fragmentPrevBatch;
+        if (auto* store = persistentTimeline();
+            store && !store->contains(events.back()->id()))
+            store->setPrevBatch(prevBatch);
+        addHistoricalMessageEvents(move(events));
+        paginationTokens[timeline.front().index()] = prevBatch;
+        return true;
+    }
+
+    // Extended forward, the fragment fills (a part of) the gap before
+    // the event it has met, and what remains of the gap is before
+    // the fragment. Extended back, the fragment follows the event it has
+    // met, and the gap before the next event, if any, stays.
+    const auto oldestEventId = events.back()->id();
+    const auto meetEventId = (*q->findInTimeline(beforeIndex))->id();
+    insertEventsBefore(beforeIndex, move(events));
+    if (placement == Newer)
+        setGapBefore(meetEventId, {});
+    if (placement == Newer && !fragmentPrevBatch.isEmpty()) {
+        setGapBefore(oldestEventId, fragmentPrevBatch);
+        paginationTokens[eventsIndex.value(oldestEventId)] = fragmentPrevBatch;
+    }
+    requestGapFill();
+    return true;
+}
+
+void Room::Private::getFragmentContent(const QString& eventId, int limit,
+                                       EventsPlacement placement)
+{
+    const auto f = findFragment(eventId);
+    if (f == fragments.end() || isJobRunning(f->job))
+        return;
+    const auto& from = placement == Older ? f->prevBatch : f->nextBatch;
+    if (from.isEmpty())
+        return;
+
+    auto* job = connection->callApi<GetRoomEventsJob>(
+        id, from, placement == Older ? "b" : "f", "", limit);
+    f->job = job;
+    connect(job, &BaseJob::success, q, [this, job, eventId, placement] {
+        auto f = findFragment(eventId);
+        if (f == fragments.end())
+            return; // Merged into the timeline in the meantime
+        auto events = job->chunk();
+        // No events means the end of the history in that direction
+        const auto token = events.empty() ? QString() : job->end();
+        if (extendFragment(f, move(events), placement, token)
+            == fragments.end())
+            emit q->fragmentMerged(eventId);
+        else
+            emit q->fragmentChanged(eventId);
+    });
+}
+
+void Room::loadEventContext(const QString& eventId, int limit)
+{
+    if (d->eventsIndex.contains(eventId)
+        || d->findFragment(eventId) != d->fragments.end()) {
+        emit eventContextLoaded(eventId);
+        return;
+    }
+    auto* job = connection()->callApi<GetEventContextJob>(id(), eventId, limit);
+    connect(job, &BaseJob::success, this, [this, job, eventId] {
+        auto events = job->eventsBefore(); // From the newest to the oldest
+        std::reverse(events.begin(), events.end());
+        if (auto evt = job->event())
+            events.emplace_back(move(evt));
+        for (auto&& evt : job->eventsAfter())
+            events.emplace_back(move(evt));
+        d->addFragment(move(events), eventId, job->begin(), job->end());
+        emit eventContextLoaded(eventId);
+    });
+}
+
+void Room::getFragmentPreviousContent(const QString& eventId, int limit)
+{
+    d->getFragmentContent(eventId, limit, Older);
+}
+
+void Room::getFragmentNextContent(const QString& eventId, int limit)
+{
+    d->getFragmentContent(eventId, limit, Newer);
+}
+
+const RoomEvents& Room::fragmentEvents(const QString& eventId) const
+{
+    static const RoomEvents NoEvents;
+    const auto f = d->findFragment(eventId);
+    return f == d->fragments.end() ? NoEvents : f->events;
+}
+
+bool Room::hasGapBefore(const QString& eventId) const
+{
+    return d->gapTokens.contains(eventId);
+}
+
 void Room::inviteToRoom(const QString& memberId)
 {
     connection()->callApi<InviteUserJob>(id(), memberId);
@@ -1935,18 +2963,24 @@ void Room::Private::dropDuplicateEvents(RoomEvents& events) const
     if (events.empty())
         return;
 
-    // Multiple-remove (by different criteria), single-erase
-    // 1. Check for duplicates against the timeline.
-    auto dupsBegin =
+    QElapsedTimer et;
+    et.start();
+    // A single pass checks each event both against the timeline and against
+    // the events before it in the batch; remove_if() keeps the order of
+    // the remaining events
+    QSet<QString> batchIds;
+    batchIds.reserve(int(events.size()));
+    const auto dupsBegin =
         remove_if(events.begin(), events.end(), [&](const RoomEventPtr& e) {
-            return eventsIndex.contains(e->id());
-        });
-
-    // 2. Check for duplicates within the batch if there are still events.
-    for (auto eIt = events.begin(); distance(eIt, dupsBegin) > 1; ++eIt)
-        dupsBegin = remove_if(eIt + 1, dupsBegin, [&](const RoomEventPtr& e) {
-            return e->id() == (*eIt)->id();
+            const auto& id = e->id();
+            if (eventsIndex.contains(id) || batchIds.contains(id))
+                return true;
+            batchIds.insert(id);
+            return false;
         });
+    if (et.nsecsElapsed() >= profilerMinNsecs())
+        qCDebug(PROFILER) << "*** Room::dropDuplicateEvents():"
+                          << events.size() << "event(s)," << et;
     if (dupsBegin == events.end())
         return;
 
@@ -2038,11 +3072,26 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
 
     // Make a new event from the redacted JSON and put it in the timeline
     // instead of the redacted one. oldEvent will be deleted on return.
+    const auto wasNotable = isEventNotable(ti);
     auto oldEvent = ti.replaceEvent(makeRedacted(*ti, redaction));
     qCDebug(EVENTS) << "Redacted" << oldEvent->id() << "with" << redaction.id();
+    notableEvents.set(ti.index(), false);
+    if (wasNotable && unreadMessages > 0) {
+        // Redacting an unread message leaves one less to read
+        const auto readMarker = q->readMarker();
+        if (readMarker != timeline.crend() ? ti.index() > readMarker->index()
+                                           : readMarkerEvicted()) {
+            if (--unreadMessages == 0)
+                unreadMessages = -1;
+            emit q->unreadMessagesChanged(q);
+        }
+    }
+    if (auto* store = persistentTimeline()) {
+        store->updateEvent(*ti);
+        store->flush();
+    }
     if (oldEvent->isStateEvent()) {
-        const StateEventKey evtKey { oldEvent->matrixType(),
-                                     oldEvent->stateKey() };
+        const auto evtKey = oldEvent->stateEventKey();
         Q_ASSERT(currentState.contains(evtKey));
         if (currentState.value(evtKey) == oldEvent.get()) {
             Q_ASSERT(ti.index() >= 0); // Historical states can't be in
@@ -2110,6 +3159,11 @@ bool Room::Private::processReplacement(const RoomMessageEvent& newEvent)
     // instead of the redacted one. oldEvent will be deleted on return.
     auto oldEvent = ti.replaceEvent(makeReplaced(*ti, newEvent));
     qCDebug(EVENTS) << "Replaced" << oldEvent->id() << "with" << newEvent.id();
+    notableEvents.set(ti.index(), isEventNotable(ti));
+    if (auto* store = persistentTimeline()) {
+        store->updateEvent(*ti);
+        store->flush();
+    }
     emit q->replacedEvent(ti.event(), rawPtr(oldEvent));
     return true;
 }
@@ -2147,39 +3201,47 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
         // NB: We have to store redacting/replacing events to the timeline too -
         // see #220.
         auto it = std::find_if(events.begin(), events.end(), isEditing);
+        // Redactions and edits that don't find their targets in the timeline
+        // look for them in the batch, using an index built once per batch
+        QHash<QString, int> batchIndex;
+        if (it != events.end()) {
+            batchIndex.reserve(int(events.size()));
+            for (int i = 0; i < int(events.size()); ++i)
+                batchIndex.insert(events[i]->id(), i);
+        }
+        const auto findInBatch = [&](const QString& id) {
+            const auto idxIt = batchIndex.constFind(id);
+            return idxIt == batchIndex.cend() ? events.end()
+                                              : events.begin() + *idxIt;
+        };
         for (const auto& eptr : RoomEventsRange(it, events.end())) {
             if (auto* r = eventCast<RedactionEvent>(eptr)) {
                 // Try to find the target in the timeline, then in the batch.
                 if (processRedaction(*r))
                     continue;
-                if (auto targetIt = std::find_if(events.begin(), events.end(),
-                        [id = r->redactedEvent()](const RoomEventPtr& ep) {
-                            return ep->id() == id;
-                        }); targetIt != events.end())
+                if (auto targetIt = findInBatch(r->redactedEvent());
+                    targetIt != events.end())
                     *targetIt = makeRedacted(**targetIt, *r);
                 else
                     qCDebug(EVENTS)
                         << "Redaction" << r->id() << "ignored: target event"
                         << r->redactedEvent() << "is not found";
-                // If the target event comes later, it comes already redacted.
             }
             if (auto* msg = eventCast<RoomMessageEvent>(eptr);
                     msg && !msg->replacedEvent().isEmpty()) {
                 if (processReplacement(*msg))
                     continue;
-                auto targetIt = std::find_if(events.begin(), it,
-                        [id = msg->replacedEvent()](const RoomEventPtr& ep) {
-                            return ep->id() == id;
-                        });
-                if (targetIt != it)
+                // The replaced event may come before or after the replacing
+                // one; either way it lands in the timeline with the new
+                // content.
+                if (auto targetIt = findInBatch(msg->replacedEvent());
+                    targetIt != events.end())
                     *targetIt = makeReplaced(**targetIt, *msg);
-                else // FIXME: don't ignore, just show it wherever it arrived
+                else
                     qCDebug(EVENTS)
                         << "Replacing event" << msg->id()
                         << "ignored: replaced event" << msg->replacedEvent()
                         << "is not found";
-                // Same as with redactions above, the replaced event coming
-                // later will come already with the new content.
             }
         }
     }
@@ -2193,14 +3255,31 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
     for (const auto& eptr : events)
         roomChanges |= q->processStateEvent(*eptr);
 
+    // Pending events that have reached the server are matched by their
+    // event ids, the rest by their transaction ids; either way it's
+    // a hash lookup per incoming event
+    QHash<QString, QString> pendingTxnIds; // Event id -> transaction id
+    for (const auto& pe : unsyncedEvents)
+        if (!pe->id().isEmpty())
+            pendingTxnIds.insert(pe->id(), pe->transactionId());
+    const auto findLocalEcho = [this, &pendingTxnIds](const RoomEventPtr& e) {
+        auto txnId = pendingTxnIds.value(e->id());
+        if (txnId.isEmpty())
+            txnId = e->transactionId();
+        const auto idx = txnId.isEmpty() ? -1 : findUnsyncedEvent(txnId);
+        return idx != -1 && isEchoEvent(e, unsyncedEvents[size_t(idx)])
+                   ? idx
+                   : -1;
+    };
+
     auto timelineSize = timeline.size();
     size_t totalInserted = 0;
     for (auto it = events.begin(); it != events.end();) {
-        auto nextPendingPair =
-            findFirstOf(it, events.end(), unsyncedEvents.begin(),
-                        unsyncedEvents.end(), isEchoEvent);
-        const auto& remoteEcho = nextPendingPair.first;
-        const auto& localEcho = nextPendingPair.second;
+        auto remoteEcho = it;
+        int pendingEvtIdx = -1;
+        for (; remoteEcho != events.end(); ++remoteEcho)
+            if ((pendingEvtIdx = findLocalEcho(*remoteEcho)) != -1)
+                break;
 
         if (it != remoteEcho) {
             RoomEventsRange eventsSpan { it, remoteEcho };
@@ -2217,7 +3296,7 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
 
         it = remoteEcho + 1;
         auto* nextPendingEvt = remoteEcho->get();
-        const auto pendingEvtIdx = int(localEcho - unsyncedEvents.begin());
+        const auto localEcho = unsyncedEvents.begin() + pendingEvtIdx;
         if (localEcho->deliveryStatus() != EventStatus::ReachedServer) {
             localEcho->setReachedServer(nextPendingEvt->id());
             emit q->pendingEventChanged(pendingEvtIdx);
@@ -2234,7 +3313,7 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
         // because a signal handler may send another message, thereby altering
         // unsyncedEvents (see #286). Fortunately, unsyncedEvents only grows at
         // its back so we can rely on the index staying valid at least.
-        unsyncedEvents.erase(unsyncedEvents.begin() + pendingEvtIdx);
+        eraseUnsyncedEvent(pendingEvtIdx);
         if (auto insertedSize = moveEventsToTimeline({ remoteEcho, it }, Newer)) {
             totalInserted += insertedSize;
             q->onAddNewTimelineEvents(timeline.cend() - insertedSize);
@@ -2301,7 +3380,7 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
     for (const auto& eptr : events) {
         const auto& e = *eptr;
         if (e.isStateEvent()
-            && !currentState.contains({ e.matrixType(), e.stateKey() })) {
+            && !currentState.contains(e.stateEventKey())) {
             q->processStateEvent(e);
         }
     }
@@ -2316,6 +3395,21 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
     q->onAddHistoricalTimelineEvents(from);
     emit q->addedMessages(timeline.front().index(), from->index());
 
+    if (relatedEventsEvicted) {
+        // Link the reactions already in the timeline to the reloaded events
+        QSet<QString> addedIds;
+        for (auto it = from; it != timeline.crend(); ++it)
+            addedIds.insert((*it)->id());
+        for (auto it = from.base(); it != timeline.cend(); ++it)
+            if (const auto* reaction = it->viewAs<ReactionEvent>()) {
+                const auto& relation = reaction->relation();
+                if (!addedIds.contains(relation.eventId))
+                    continue;
+                auto& related = relations[{ relation.eventId, relation.type }];
+                if (!related.contains(reaction))
+                    related << reaction;
+            }
+    }
     for (auto it = from; it != timeline.crend(); ++it) {
         if (const auto* reaction = it->viewAs<ReactionEvent>()) {
             const auto& relation = reaction->relation();
@@ -2323,7 +3417,10 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
             emit q->updatedEvent(relation.eventId);
         }
     }
-    if (from <= q->readMarker())
+    // The events between an evicted read marker and the timeline have been
+    // counted before eviction; the count is only updated once the marker
+    // itself is loaded again
+    if (from <= q->readMarker() && !readMarkerEvicted())
         updateUnreadCount(from, timeline.crend());
 
     Q_ASSERT(timeline.size() == timelineSize + insertedSize);
@@ -2338,11 +3435,10 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
         return Change::NoChange;
 
     const auto* oldStateEvent =
-        std::exchange(d->currentState[{ e.matrixType(), e.stateKey() }],
+        std::exchange(d->currentState[e.stateEventKey()],
                       static_cast<const StateEventBase*>(&e));
     Q_ASSERT(!oldStateEvent
-             || (oldStateEvent->matrixType() == e.matrixType()
-                 && oldStateEvent->stateKey() == e.stateKey()));
+             || oldStateEvent->stateEventKey() == e.stateEventKey());
     if (!is<RoomMemberEvent>(e)) // Room member events are too numerous
         qCDebug(STATE) << "Room state event:" << e;
 
@@ -2498,6 +3594,16 @@ Room::Changes Room::processEphemeralEvent(EventPtr&& event)
     }
     if (auto* evt = eventCast<ReceiptEvent>(event)) {
         int totalReceipts = 0;
+        // Find the newest receipt of each user first, so that the marker
+        // of each user moves at most once per batch; the users are kept in
+        // the order of their first receipts in the batch
+        struct UserReceipt {
+            User* user;
+            rev_iter_t marker;
+            QString eventId; //< Only used if the marker is not found
+        };
+        std::vector<UserReceipt> userReceipts;
+        QHash<User*, size_t> userReceiptPositions;
         for (const auto& p : qAsConst(evt->eventsWithReceipts())) {
             totalReceipts += p.receipts.size();
             {
@@ -2509,31 +3615,41 @@ Room::Changes Room::processEphemeralEvent(EventPtr&& event)
                                        << p.receipts.size() << "users";
             }
             const auto newMarker = findInTimeline(p.evtId);
-            if (newMarker != timelineEdge()) {
-                for (const Receipt& r : p.receipts) {
-                    if (r.userId == connection()->userId())
-                        continue; // FIXME, #185
-                    auto u = user(r.userId);
-                    if (memberJoinState(u) == JoinState::Join)
-                        changes |= d->promoteReadMarker(u, newMarker);
-                }
-            } else {
+            if (newMarker == timelineEdge())
                 qCDebug(EPHEMERAL) << "Event" << p.evtId
                                    << "not found; saving read receipts anyway";
-                // If the event is not found (most likely, because it's too old
-                // and hasn't been fetched from the server yet), but there is
-                // a previous marker for a user, keep the previous marker.
-                // Otherwise, blindly store the event id for this user.
-                for (const Receipt& r : p.receipts) {
-                    if (r.userId == connection()->userId())
-                        continue; // FIXME, #185
-                    auto u = user(r.userId);
-                    if (memberJoinState(u) == JoinState::Join
-                        && readMarker(u) == timelineEdge())
-                        changes |= d->setLastReadEvent(u, p.evtId);
-                }
+            for (const Receipt& r : p.receipts) {
+                if (r.userId == connection()->userId())
+                    continue; // FIXME, #185
+                auto u = user(r.userId);
+                if (memberJoinState(u) != JoinState::Join)
+                    continue;
+                const auto it = userReceiptPositions.constFind(u);
+                if (it == userReceiptPositions.cend()) {
+                    userReceiptPositions.insert(u, userReceipts.size());
+                    userReceipts.push_back({ u, newMarker, p.evtId });
+                } else if (auto& ur = userReceipts[*it];
+                           newMarker < ur.marker) // Reverse iterators
+                    ur = { u, newMarker, p.evtId };
+            }
+        }
+        Private::ReadReceiptMoves moves;
+        moves.reserve(userReceipts.size());
+        for (const auto& ur : userReceipts) {
+            const auto prevMarker = readMarker(ur.user);
+            if (ur.marker != timelineEdge()) {
+                if (ur.marker < prevMarker) // Reverse iterators
+                    moves.emplace_back(ur.user,
+                                       d->eagerReadEventId(ur.user, ur.marker));
             }
+            // If the event is not found (most likely, because it's too old
+            // and hasn't been fetched from the server yet), but there is
+            // a previous marker for a user, keep the previous marker.
+            // Otherwise, blindly store the event id for this user.
+            else if (prevMarker == timelineEdge())
+                moves.emplace_back(ur.user, ur.eventId);
         }
+        changes |= d->setLastReadEvents(move(moves));
         if (evt->eventsWithReceipts().size() > 3 || totalReceipts > 10
             || et.nsecsElapsed() >= profilerMinNsecs())
             qCDebug(PROFILER)
@@ -2741,6 +3857,33 @@ QJsonObject Room::Private::toJson() const
                           { QStringLiteral("events"), accountDataEvents } });
     }
 
+    result.insert(QStringLiteral("unread_notifications"),
+                  unreadNotificationsJson());
+
+    if (et.elapsed() > 30)
+        qCDebug(PROFILER) << "Room::toJson() for" << displayname << "took" << et;
+
+    return result;
+}
+
+QJsonObject Room::Private::toIndexJson() const
+{
+    QJsonObject result;
+    addParam<IfNotEmpty>(result, QStringLiteral("summary"), summary);
+    result.insert(DisplaynameIndexKey, displayname);
+    const auto tagsIt = accountData.find(TagEvent::matrixTypeId());
+    if (tagsIt != accountData.end()) {
+        const QJsonArray events { tagsIt->second->fullJson() };
+        result.insert(QStringLiteral("account_data"),
+                      QJsonObject { { QStringLiteral("events"), events } });
+    }
+    result.insert(QStringLiteral("unread_notifications"),
+                  unreadNotificationsJson());
+    return result;
+}
+
+QJsonObject Room::Private::unreadNotificationsJson() const
+{
     QJsonObject unreadNotifObj { { SyncRoomData::UnreadCountKey,
                                    unreadMessages } };
 
@@ -2749,16 +3892,33 @@ QJsonObject Room::Private::toJson() const
     if (notificationCount > 0)
         unreadNotifObj.insert(QStringLiteral("notification_count"),
                               notificationCount);
+    return unreadNotifObj;
+}
 
-    result.insert(QStringLiteral("unread_notifications"), unreadNotifObj);
+QJsonObject Room::toJson() const { return d->toJson(); }
 
-    if (et.elapsed() > 30)
-        qCDebug(PROFILER) << "Room::toJson() for" << displayname << "took" << et;
+QJsonObject Room::toIndexJson() const { return d->toIndexJson(); }
 
-    return result;
+void Room::loadIndexJson(const QJsonObject& indexJson)
+{
+    updateData(SyncRoomData(id(), joinState(), indexJson), true);
+    // Without the state events the calculated name is of little use;
+    // take the one saved along with the index until the room is loaded
+    auto cachedName = indexJson.value(DisplaynameIndexKey).toString();
+    if (!cachedName.isEmpty() && cachedName != d->displayname) {
+        emit displaynameAboutToChange(this);
+        swap(d->displayname, cachedName);
+        emit displaynameChanged(this, cachedName);
+    }
 }
 
-QJsonObject Room::toJson() const { return d->toJson(); }
+void Room::dropPersistentTimeline()
+{
+    d->timelineStoreDropped = true;
+    if (d->timelineStore)
+        d->timelineStore->clear();
+    d->timelineStore.reset();
+}
 
 MemberSorter Room::memberSorter() const { return MemberSorter(this); }
 
@@ -290,6 +290,14 @@ public:
     Timeline::const_iterator syncEdge() const;
     /// \deprecated Use historyEdge instead
     rev_iter_t timelineEdge() const;
+    /// The index of the oldest event loaded in the timeline
+    /**
+     * An event keeps its timeline index while it is in the timeline: new
+     * events get indices after maxTimelineIndex() and historical ones get
+     * indices before minTimelineIndex(). The only exception is insertion
+     * in the middle of the timeline, which clients opt in to with
+     * Connection::timelineInsertion(); see aboutToInsertMessages().
+     */
     Q_INVOKABLE Quotient::TimelineItem::index_t minTimelineIndex() const;
     Q_INVOKABLE Quotient::TimelineItem::index_t maxTimelineIndex() const;
     Q_INVOKABLE bool
@@ -300,6 +308,26 @@ public:
     PendingEvents::iterator findPendingEvent(const QString& txnId);
     PendingEvents::const_iterator findPendingEvent(const QString& txnId) const;
 
+    /// Whether some events are missing right before the given one
+    /**
+     * A gap appears when a sync response is limited, i.e. the server
+     * skipped some events between the previous sync and this one.
+     * With Connection::gapFilling() enabled gaps are filled in
+     * the background; otherwise the events come
+     * when the user scrolls the history back to the gap.
+     */
+    bool hasGapBefore(const QString& eventId) const;
+
+    /// Events of the detached timeline fragment that has the given event
+    /**
+     * Fragments are parts of the room history that are not connected to
+     * the timeline, e.g. loaded with loadEventContext(). Events in
+     * the returned list go from the oldest to the newest; the list is
+     * empty if the event is not in a fragment (but it may be in
+     * the timeline - see findInTimeline()).
+     */
+    const RoomEvents& fragmentEvents(const QString& eventId) const;
+
     const RelatedEvents relatedEvents(const QString& evtId,
                                       const char* relType) const;
     const RelatedEvents relatedEvents(const RoomEvent& evt,
@@ -319,6 +347,24 @@ public:
      * measure that "screen time".
      */
     void setDisplayed(bool displayed = true);
+
+    /// The maximum number of timeline events kept in memory
+    /**
+     * When a room that is not displayed gets more events than that,
+     * the oldest events are evicted from memory. Timeline indices of
+     * the remaining events don't change; evicted events are loaded again
+     * by getPreviousContent(), from the timeline store if it's enabled
+     * (see Connection::cacheTimeline()) or from the server. Eviction only
+     * happens at events that can be reloaded, so the timeline may exceed
+     * the limit until such an event comes. 0 (default) means no limit.
+     *
+     * The read marker may be evicted too; readMarker() then returns
+     * timelineEdge() but unreadCount() stays exact, since the events past
+     * the marker have been counted before.
+     */
+    int timelineLimit() const;
+    void setTimelineLimit(int limit);
+
     QString firstDisplayedEventId() const;
     rev_iter_t firstDisplayedMarker() const;
     void setFirstDisplayedEventId(const QString& eventId);
@@ -331,6 +377,8 @@ public:
     rev_iter_t readMarker(const User* user) const;
     rev_iter_t readMarker() const;
     QString readMarkerEventId() const;
+    /// Users whose read receipts point at the event
+    /** The users come in the order their receipts arrived at the event. */
     QList<User*> usersAtEventId(const QString& eventId);
     /**
      * \brief Mark the event with uptoEventId as read
@@ -352,9 +400,10 @@ public:
      * are counted.
      *
      * In a case when readMarker() == timelineEdge() (the local read
-     * marker is beyond the local timeline) only the bottom limit of
-     * the unread messages number can be estimated (and even that may
-     * be slightly off due to, e.g., redactions of events not loaded
+     * marker is beyond the local timeline) and the marker has not been
+     * evicted from the timeline (see setTimelineLimit()), only the bottom
+     * limit of the unread messages number can be estimated (and even that
+     * may be slightly off due to, e.g., redactions of events not loaded
      * to the local timeline).
      *
      * If all messages are read, this function will return -1 (_not_ 0,
@@ -546,6 +595,26 @@ public slots:
 
     void getPreviousContent(int limit = 10);
 
+    /// Load events around the given event without loading those in between
+    /**
+     * Unless the event is already in the timeline or in a fragment, this
+     * loads the event along with \p limit events around it into a new
+     * detached fragment; eventContextLoaded() is emitted in either case.
+     * The fragment can be extended in both directions with
+     * getFragmentPreviousContent() and getFragmentNextContent(). Once it
+     * reaches the oldest loaded event or back-pagination reaches it, it is
+     * merged into the timeline (see fragmentMerged()). A fragment that
+     * meets the timeline elsewhere is only merged with
+     * Connection::timelineInsertion() enabled, and stays detached
+     * otherwise.
+     * \sa fragmentEvents
+     */
+    void loadEventContext(const QString& eventId, int limit = 20);
+    /// Load events preceding the fragment that has the given event
+    void getFragmentPreviousContent(const QString& eventId, int limit = 10);
+    /// Load events following the fragment that has the given event
+    void getFragmentNextContent(const QString& eventId, int limit = 10);
+
     void inviteToRoom(const QString& memberId);
     LeaveRoomJob* leaveRoom();
     /// \deprecated - use setState() instead")
@@ -593,6 +662,50 @@ signals:
     void aboutToAddHistoricalMessages(RoomEventsRange events);
     void aboutToAddNewMessages(RoomEventsRange events);
     void addedMessages(int fromIndex, int toIndex);
+    /// Events with indices from fromIndex to toIndex are about to be evicted
+    /// \sa timelineLimit
+    void aboutToEvictMessages(int fromIndex, int toIndex);
+    void evictedMessages(int fromIndex, int toIndex);
+    /// Events are about to be inserted in the middle of the timeline
+    /**
+     * This resets the timeline indices: any index obtained before this
+     * signal should be looked up again (e.g. by event id) after
+     * insertedMessages(). The events, from the newest to the oldest, are
+     * put right before the event with \p beforeIndex. To make room for them,
+     * the events on the side of the insertion point with fewer events are
+     * renumbered: either the newer events get their indices increased or
+     * the older ones get them decreased by the number of inserted events;
+     * the events on the other side keep their indices. Renumbering takes
+     * time proportional to the number of events on the shorter side.
+     *
+     * Counted as rows from minTimelineIndex(), the events before
+     * the insertion point keep their rows and the newer ones move down
+     * either way, so a model with such rows can treat this as an insertion
+     * of rows. insertedMessages() comes after that with the range of
+     * the new indices.
+     *
+     * This only happens with Connection::timelineInsertion() enabled, when
+     * a gap in the timeline is filled or a fragment is merged in the middle
+     * of the timeline.
+     */
+    void aboutToInsertMessages(RoomEventsRange events, int beforeIndex);
+    void insertedMessages(int fromIndex, int toIndex);
+    /// The event and the events around it are available
+    /// \sa loadEventContext
+    void eventContextLoaded(QString eventId);
+    /// The detached fragment that has the given event has changed
+    void fragmentChanged(QString eventId);
+    /// The fragment that had the given event has become a part of the timeline
+    /**
+     * The fragment events have been added to the timeline by then. At
+     * the older end of the timeline, they come with
+     * aboutToAddHistoricalMessages() and addedMessages(), and no index
+     * changes. In the middle of the timeline (only with
+     * Connection::timelineInsertion() enabled), they come with
+     * aboutToInsertMessages() and insertedMessages(), which renumber
+     * the events on one side of the fragment.
+     */
+    void fragmentMerged(QString eventId);
     /// The event is about to be appended to the list of pending events
     void pendingEventAboutToAdd(RoomEvent* event);
     /// An event has been appended to the list of pending events
@@ -723,6 +836,21 @@ private:
     // arrived from the server. Clients should use
     // Connection::joinRoom() and Room::leaveRoom() to change the state.
     void setJoinState(JoinState state);
+
+    // These are called from Connection to save the room to, and restore it
+    // from, the compact room index of the state cache (see
+    // Connection::lazyCacheLoading()).
+    QJsonObject toIndexJson() const;
+    void loadIndexJson(const QJsonObject& indexJson);
+
+    // Called from Connection when the room is forgotten, to delete
+    // the persistent timeline (see Connection::cacheTimeline()).
+    void dropPersistentTimeline();
+
+    // Called from Connection when it's the room's turn to fill a gap in
+    // the timeline (see Connection::gapFilling()); returns nullptr if
+    // there's nothing to request.
+    GetRoomEventsJob* fillNextGap();
 };
 
 class MemberSorter {
@@ -20,13 +20,30 @@
 
 #include "events/eventloader.h"
 
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtCore/QCborStreamReader>
+#include <QtCore/QCborValue>
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
+#include <QtCore/QFuture>
+#include <QtCore/QSemaphore>
+#include <QtCore/QThreadPool>
+#include <QtCore/QtEndian>
+
+#include <algorithm>
 
 using namespace Quotient;
 
 const QString SyncRoomData::UnreadCountKey =
     QStringLiteral("x-quotient.unread_count");
+const QString SyncData::SyncFilterKey =
+    QStringLiteral("x-quotient.sync_filter");
+const QString SyncData::RoomIndexKey = QStringLiteral("x-quotient.room_index");
+
+/// Smaller batches are not worth the overhead of spreading over threads
+static constexpr size_t MinRoomsForParallelDecoding = 8;
+/// The number of state cache files read at the same time
+static constexpr int MaxConcurrentCacheReads = 4;
 
 bool RoomSummary::isEmpty() const
 {
@@ -94,7 +111,13 @@ SyncRoomData::SyncRoomData(const QString& roomId_, JoinState joinState_,
         [[fallthrough]];
     case JoinState::Leave: {
         accountData = load<Events>(room_, "account_data"_ls);
-        timeline = load<RoomEvents>(room_, "timeline"_ls);
+        {
+            // Timeline events come and go together (see
+            // Room::setTimelineLimit()); the state and account data stay
+            // with the room and would pin the chunks for good
+            const EventArenaScope arena;
+            timeline = load<RoomEvents>(room_, "timeline"_ls);
+        }
         const auto timelineJson = room_.value("timeline"_ls).toObject();
         timelineLimited = timelineJson.value("limited"_ls).toBool();
         timelinePrevBatch = timelineJson.value("prev_batch"_ls).toString();
@@ -114,10 +137,11 @@ SyncRoomData::SyncRoomData(const QString& roomId_, JoinState joinState_,
                          << "and notifications:" << notificationCount;
 }
 
-SyncData::SyncData(const QString& cacheFileName)
+SyncData::SyncData(const QString& cacheFileName, bool skipIndexedRooms)
+    : skipIndexedRooms(skipIndexedRooms)
 {
     QFileInfo cacheFileInfo { cacheFileName };
-    auto json = loadJson(cacheFileName);
+    auto json = loadJson(cacheFileName, &cacheFormat_);
     auto requiredVersion = std::get<0>(cacheVersion());
     auto actualVersion =
         json.value("cache_version"_ls).toObject().value("major"_ls).toInt();
@@ -143,7 +167,319 @@ Events&& SyncData::takeAccountData() { return std::move(accountData); }
 
 Events&& SyncData::takeToDeviceEvents() { return std::move(toDeviceEvents); }
 
-QJsonObject SyncData::loadJson(const QString& fileName)
+static const char* const CacheFormatNames[] = { "JSON", "Qt binary JSON",
+                                                 "records" };
+static const auto RecordsMagic = QByteArrayLiteral("QSCR");
+/// Record types; the skeleton and event payloads are in CBOR, and the index
+/// goes after the skeleton
+enum RecordType : quint8 {
+    SkeletonRecord = 1,
+    IndexRecord = 2,
+    EventRecord = 3
+};
+// Record size (4 bytes), type (1 byte) and section name size (1 byte)
+static constexpr int RecordHeaderSize = 6;
+// Section name size (1 byte) before the name; then the number of records,
+// the offset of the first record from the end of the index record and
+// the size of all records in the section (4 bytes each)
+static constexpr int IndexEntrySize = 1 + 3 * 4;
+
+static void appendRecord(QByteArray& out, RecordType type,
+                         const QByteArray& section, const QByteArray& payload)
+{
+    Q_ASSERT(section.size() <= 0xFF);
+    const auto start = out.size();
+    out.resize(start + RecordHeaderSize);
+    qToBigEndian<quint32>(quint32(2 + section.size() + payload.size()),
+                          out.data() + start);
+    out[start + 4] = char(type);
+    out[start + 5] = char(section.size());
+    out.append(section).append(payload);
+}
+
+namespace {
+struct CacheRecord {
+    quint8 type;
+    QByteArray section;
+    QByteArray payload; //< Refers to the data without copying
+};
+
+/// Reads records one by one, checking their boundaries
+class RecordReader {
+public:
+    RecordReader(const char* begin, const char* end, const QString& fileName)
+        : p(begin), end(end), fileName(&fileName)
+    {}
+
+    bool atEnd() const { return p == end; }
+    const char* pos() const { return p; }
+
+    bool read(CacheRecord& record)
+    {
+        if (end - p < RecordHeaderSize)
+            return fail("is truncated");
+        const auto size = qFromBigEndian<quint32>(p);
+        if (size < 2 || size > quint32(end - p - 4))
+            return fail("has a broken record");
+        const auto* const recordEnd = p + 4 + size;
+        const auto sectionSize = quint8(p[5]);
+        const auto* const payload = p + RecordHeaderSize + sectionSize;
+        if (payload > recordEnd)
+            return fail("has a broken record");
+        record.type = quint8(p[4]);
+        record.section = QByteArray::fromRawData(p + RecordHeaderSize,
+                                                 sectionSize);
+        record.payload = QByteArray::fromRawData(
+            payload, static_cast<int>(recordEnd - payload));
+        p = recordEnd;
+        return true;
+    }
+
+    bool fail(const char* what)
+    {
+        qCWarning(MAIN) << "State cache in" << *fileName << what;
+        return false;
+    }
+
+private:
+    const char* p;
+    const char* end;
+    const QString* fileName;
+};
+
+QString readCborString(QCborStreamReader& reader)
+{
+    QString result;
+    auto chunk = reader.readString();
+    for (; chunk.status == QCborStreamReader::Ok; chunk = reader.readString())
+        result += chunk.data;
+    return result;
+}
+
+/// Read a CBOR item as JSON, consuming it
+/** Only the items that QCborValue::fromJsonValue() makes are accepted. */
+bool readCborValue(QCborStreamReader& reader, QJsonValue& value)
+{
+    switch (reader.type()) {
+    case QCborStreamReader::Map: {
+        QJsonObject object;
+        QJsonValue item;
+        reader.enterContainer();
+        while (reader.hasNext()) {
+            if (!reader.isString())
+                return false;
+            const auto key = readCborString(reader);
+            if (!readCborValue(reader, item))
+                return false;
+            object.insert(key, item);
+        }
+        value = object;
+        return reader.leaveContainer();
+    }
+    case QCborStreamReader::Array: {
+        QJsonArray array;
+        QJsonValue item;
+        reader.enterContainer();
+        while (reader.hasNext()) {
+            if (!readCborValue(reader, item))
+                return false;
+            array.append(item);
+        }
+        value = array;
+        return reader.leaveContainer();
+    }
+    case QCborStreamReader::String:
+        value = readCborString(reader);
+        return reader.lastError() == QCborError::NoError;
+    case QCborStreamReader::UnsignedInteger:
+    case QCborStreamReader::NegativeInteger:
+        value = reader.toInteger();
+        break;
+    case QCborStreamReader::Float:
+        value = double(reader.toFloat());
+        break;
+    case QCborStreamReader::Double:
+        value = reader.toDouble();
+        break;
+    case QCborStreamReader::SimpleType:
+        if (reader.isBool())
+            value = reader.toBool();
+        else if (reader.isNull())
+            value = QJsonValue::Null;
+        else
+            return false;
+        break;
+    default:
+        return false;
+    }
+    return reader.next();
+}
+
+/// Decode a CBOR payload straight into a JSON object
+/** Unlike QCborValue::fromCbor(payload).toMap().toJsonObject(), this
+ * doesn't make a QCborValue on the way.
+ */
+bool readCborPayload(const QByteArray& payload, QJsonObject& json)
+{
+    QCborStreamReader reader(payload);
+    QJsonValue value;
+    if (!reader.isMap() || !readCborValue(reader, value))
+        return false;
+    json = value.toObject();
+    return true;
+}
+
+QByteArray toCborPayload(const QJsonObject& json)
+{
+    return QCborValue::fromJsonValue(json).toCbor();
+}
+
+/// Read the event records of the sections listed in the index record
+bool readIndexedSections(const QByteArray& index, const char* eventsStart,
+                         const char* end, const QString& fileName,
+                         QHash<QString, QJsonArray>& sections,
+                         const char*& eventsEnd)
+{
+    const auto* p = index.constData();
+    const auto* const indexEnd = p + index.size();
+    eventsEnd = eventsStart;
+    while (p != indexEnd) {
+        const auto nameSize = quint8(*p);
+        if (indexEnd - p < IndexEntrySize + nameSize)
+            return false;
+        const auto sectionName = QString::fromUtf8(p + 1, nameSize);
+        p += 1 + nameSize;
+        const auto count = qFromBigEndian<quint32>(p);
+        const auto offset = qFromBigEndian<quint32>(p + 4);
+        const auto size = qFromBigEndian<quint32>(p + 8);
+        p += 12;
+        if (offset > quint32(end - eventsStart)
+            || size > quint32(end - eventsStart) - offset)
+            return false;
+        // Sections can be located and skipped without reading any records
+        RecordReader reader(eventsStart + offset, eventsStart + offset + size,
+                            fileName);
+        auto& events = sections[sectionName];
+        CacheRecord record;
+        QJsonObject event;
+        for (quint32 i = 0; i < count; ++i) {
+            if (!reader.read(record) || record.type != EventRecord
+                || !readCborPayload(record.payload, event))
+                return false;
+            events.append(event);
+        }
+        if (!reader.atEnd())
+            return false;
+        eventsEnd = std::max(eventsEnd, reader.pos());
+    }
+    return true;
+}
+} // namespace
+
+static QJsonObject decodeRecords(const QByteArray& data,
+                                 const QString& fileName)
+{
+    const auto* p = data.constData() + RecordsMagic.size();
+    const auto* const end = data.constData() + data.size();
+    if (end - p < 4) {
+        qCWarning(MAIN) << "State cache in" << fileName << "has no header";
+        return {};
+    }
+    const auto major = qFromBigEndian<quint16>(p);
+    p += 4; // Later minor versions may add record types, skipped below
+    if (major != SyncData::cacheVersion().first) {
+        qCWarning(MAIN) << "Major version of" << fileName << "is" << major
+                        << "but" << SyncData::cacheVersion().first
+                        << "is required; discarding the cache";
+        return {};
+    }
+
+    QJsonObject skeleton;
+    QHash<QString, QJsonArray> sections;
+    RecordReader reader(p, end, fileName);
+    CacheRecord record;
+    while (!reader.atEnd()) {
+        if (!reader.read(record))
+            return {};
+        switch (record.type) {
+        case SkeletonRecord:
+            if (!readCborPayload(record.payload, skeleton)) {
+                reader.fail("has a broken skeleton record");
+                return {};
+            }
+            break;
+        case IndexRecord: {
+            const char* eventsEnd = nullptr;
+            if (!readIndexedSections(record.payload, reader.pos(), end,
+                                     fileName, sections, eventsEnd)) {
+                reader.fail("has a broken index");
+                return {};
+            }
+            // Continue after the indexed records
+            reader = RecordReader(eventsEnd, end, fileName);
+            break;
+        }
+        default:; // Records added in later minor versions are skipped
+        }
+    }
+    for (auto it = sections.cbegin(); it != sections.cend(); ++it) {
+        auto section = skeleton.value(it.key()).toObject();
+        section.insert("events"_ls, it.value());
+        skeleton.insert(it.key(), section);
+    }
+    return skeleton;
+}
+
+QByteArray SyncData::encodeCache(const QJsonObject& json, CacheFormat format)
+{
+    switch (format) {
+    case CacheFormat::Json:
+        return QJsonDocument(json).toJson(QJsonDocument::Compact);
+    case CacheFormat::QtBinary:
+        return QJsonDocument(json).toBinaryData();
+    case CacheFormat::Records:
+        break;
+    }
+
+    QByteArray result = RecordsMagic;
+    result.resize(RecordsMagic.size() + 4);
+    qToBigEndian<quint16>(quint16(cacheVersion().first),
+                          result.data() + RecordsMagic.size());
+    qToBigEndian<quint16>(quint16(cacheVersion().second),
+                          result.data() + RecordsMagic.size() + 2);
+
+    auto skeleton = json;
+    QByteArray index;
+    QByteArray eventRecords;
+    for (auto it = json.begin(); it != json.end(); ++it) {
+        auto section = it->toObject();
+        const auto events = section.take("events"_ls).toArray();
+        const auto sectionName = it.key().toUtf8();
+        if (events.isEmpty() || sectionName.size() > 0xFF)
+            continue;
+        skeleton.insert(it.key(), section);
+        const auto sectionStart = eventRecords.size();
+        for (const auto& e : events)
+            appendRecord(eventRecords, EventRecord, sectionName,
+                         toCborPayload(e.toObject()));
+
+        const auto entryStart = index.size();
+        index.resize(entryStart + IndexEntrySize + sectionName.size());
+        auto* entry = index.data() + entryStart;
+        *entry = char(sectionName.size());
+        std::copy(sectionName.cbegin(), sectionName.cend(), entry + 1);
+        entry += 1 + sectionName.size();
+        qToBigEndian<quint32>(quint32(events.size()), entry);
+        qToBigEndian<quint32>(quint32(sectionStart), entry + 4);
+        qToBigEndian<quint32>(quint32(eventRecords.size() - sectionStart),
+                              entry + 8);
+    }
+    appendRecord(result, SkeletonRecord, {}, toCborPayload(skeleton));
+    appendRecord(result, IndexRecord, {}, index);
+    return result + eventRecords;
+}
+
+static QByteArray readCacheFile(const QString& fileName)
 {
     QFile roomFile { fileName };
     if (!roomFile.exists()) {
@@ -155,53 +491,155 @@ QJsonObject SyncData::loadJson(const QString& fileName)
                         << roomFile.fileName();
         return {};
     }
-    auto data = roomFile.readAll();
+    return roomFile.readAll();
+}
 
-    const auto json = (data.startsWith('{')
-                           ? QJsonDocument::fromJson(data)
-                           : QJsonDocument::fromBinaryData(data))
-                          .object();
+static QJsonObject decodeCacheFile(const QByteArray& data,
+                                   const QString& fileName,
+                                   SyncData::CacheFormat* format = nullptr)
+{
+    using CacheFormat = SyncData::CacheFormat;
+    QElapsedTimer et;
+    et.start();
+    const auto fileFormat = data.startsWith('{') ? CacheFormat::Json
+                            : data.startsWith(RecordsMagic)
+                                ? CacheFormat::Records
+                                : CacheFormat::QtBinary;
+    const auto json =
+        fileFormat == CacheFormat::Json
+            ? QJsonDocument::fromJson(data).object()
+            : fileFormat == CacheFormat::Records
+                  ? decodeRecords(data, fileName)
+                  : QJsonDocument::fromBinaryData(data).object();
     if (json.isEmpty()) {
         qCWarning(MAIN) << "State cache in" << fileName
                         << "is broken or empty, discarding";
     }
+    if (et.nsecsElapsed() >= profilerMinNsecs())
+        qCDebug(PROFILER) << "State cache in" << fileName << "("
+                          << data.size() << "bytes of"
+                          << CacheFormatNames[size_t(fileFormat)]
+                          << ") decoded in" << et;
+    if (format)
+        *format = fileFormat;
     return json;
 }
 
+QJsonObject SyncData::loadJson(const QString& fileName, CacheFormat* format)
+{
+    const auto data = readCacheFile(fileName);
+    if (data.isEmpty())
+        return {};
+    return decodeCacheFile(data, fileName, format);
+}
+
 void SyncData::parseJson(const QJsonObject& json, const QString& baseDir)
 {
     QElapsedTimer et;
     et.start();
 
     nextBatch_ = json.value("next_batch"_ls).toString();
+    syncFilter_ = json.value(SyncFilterKey).toObject();
+    roomIndex_ = json.value(RoomIndexKey).toObject();
     presenceData = load<Events>(json, "presence"_ls);
     accountData = load<Events>(json, "account_data"_ls);
     toDeviceEvents = load<Events>(json, "to_device"_ls);
 
-    auto rooms = json.value("rooms"_ls).toObject();
+    // Rooms are independent from each other, so they are loaded from
+    // cache files (if needed) and decoded in parallel; each room keeps its
+    // place in the list so that the resulting order doesn't depend on thread
+    // scheduling.
+    struct PendingRoom {
+        QString roomId;
+        JoinState joinState;
+        QJsonObject json;
+        QString cacheFileName {}; //< Empty if the JSON is already there
+        QByteArray cacheData {};
+        std::optional<SyncRoomData> data {};
+    };
+    std::vector<PendingRoom> pendingRooms;
+
+    const auto rooms = json.value("rooms"_ls).toObject();
     JoinStates::Int ii = 1; // ii is used to make a JoinState value
     auto totalRooms = 0;
     auto totalEvents = 0;
     for (size_t i = 0; i < JoinStateStrings.size(); ++i, ii <<= 1) {
         const auto rs = rooms.value(JoinStateStrings[i]).toObject();
         // We have a Qt container on the right and an STL one on the left
-        roomData.reserve(static_cast<size_t>(rs.size()));
+        pendingRooms.reserve(pendingRooms.size()
+                             + static_cast<size_t>(rs.size()));
         for (auto roomIt = rs.begin(); roomIt != rs.end(); ++roomIt) {
-            auto roomJson =
-                roomIt->isObject()
-                    ? roomIt->toObject()
-                    : loadJson(baseDir + fileNameForRoom(roomIt.key()));
-            if (roomJson.isEmpty()) {
-                unresolvedRoomIds.push_back(roomIt.key());
+            if (skipIndexedRooms && JoinState(ii) == JoinState::Join
+                && !roomIt->isObject() && roomIndex_.contains(roomIt.key()))
                 continue;
-            }
-            roomData.emplace_back(roomIt.key(), JoinState(ii), roomJson);
-            const auto& r = roomData.back();
-            totalEvents += r.state.size() + r.ephemeral.size()
-                           + r.accountData.size() + r.timeline.size();
+            if (roomIt->isObject())
+                pendingRooms.push_back(
+                    { roomIt.key(), JoinState(ii), roomIt->toObject() });
+            else
+                pendingRooms.push_back(
+                    { roomIt.key(), JoinState(ii), {},
+                      baseDir + fileNameForRoom(roomIt.key()) });
         }
         totalRooms += rs.size();
     }
+
+    const auto decodeRoom = [](PendingRoom& room) {
+        if (!room.cacheFileName.isEmpty()) {
+            if (room.cacheData.isEmpty())
+                return;
+            room.json = decodeCacheFile(room.cacheData, room.cacheFileName);
+            room.cacheData = {};
+            if (room.json.isEmpty())
+                return;
+        }
+        room.data.emplace(room.roomId, room.joinState, room.json);
+        room.json = {}; // Release the JSON as early as possible
+    };
+    if (pendingRooms.size() >= MinRoomsForParallelDecoding) {
+        // Files are read on a small pool of their own, so that the threads
+        // waiting for the disk don't hold up the global pool; each room is
+        // handed over to the global pool for decoding once its file is read
+        QThreadPool readerPool;
+        readerPool.setMaxThreadCount(MaxConcurrentCacheReads);
+        QSemaphore roomsDecoded;
+        const auto startDecoding = [&decodeRoom, &roomsDecoded](
+                                       PendingRoom& room) {
+            QtConcurrent::run([&decodeRoom, &roomsDecoded, &room] {
+                decodeRoom(room);
+                roomsDecoded.release();
+            });
+        };
+        for (auto& room : pendingRooms)
+            if (room.cacheFileName.isEmpty())
+                startDecoding(room);
+            else
+                QtConcurrent::run(&readerPool, [&startDecoding, &room] {
+                    room.cacheData = readCacheFile(room.cacheFileName);
+                    startDecoding(room);
+                });
+        // This thread may belong to the global pool; let the pool use
+        // another thread while this one waits
+        QThreadPool::globalInstance()->releaseThread();
+        roomsDecoded.acquire(static_cast<int>(pendingRooms.size()));
+        QThreadPool::globalInstance()->reserveThread();
+    } else {
+        for (auto& room : pendingRooms) {
+            if (!room.cacheFileName.isEmpty())
+                room.cacheData = readCacheFile(room.cacheFileName);
+            decodeRoom(room);
+        }
+    }
+
+    roomData.reserve(roomData.size() + pendingRooms.size());
+    for (auto& room : pendingRooms) {
+        if (!room.data) {
+            unresolvedRoomIds.push_back(room.roomId);
+            continue;
+        }
+        const auto& r = roomData.emplace_back(std::move(*room.data));
+        totalEvents += r.state.size() + r.ephemeral.size()
+                       + r.accountData.size() + r.timeline.size();
+    }
     if (!unresolvedRoomIds.empty())
         qCWarning(MAIN) << "Unresolved rooms:" << unresolvedRoomIds.join(',');
     if (totalRooms > 9 || et.nsecsElapsed() >= profilerMinNsecs())
@@ -209,3 +647,245 @@ void SyncData::parseJson(const QJsonObject& json, const QString& baseDir)
                           << totalRooms << "room(s)," << totalEvents
                           << "event(s) in" << et;
 }
+
+/// Parse JSON text that can be any JSON value, not only an object or array
+static QJsonValue parseJsonValue(const QByteArray& json,
+                                 QJsonParseError* error)
+{
+    if (json.startsWith('{'))
+        return QJsonDocument::fromJson(json, error).object();
+    if (json.startsWith('['))
+        return QJsonDocument::fromJson(json, error).array();
+    // QJsonDocument only accepts objects and arrays at the top level
+    return QJsonDocument::fromJson('[' + json + ']', error).array().at(0);
+}
+
+static bool isLiteralChar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-'
+           || c == '+' || c == '.' || c == 'E';
+}
+
+static int joinStateIndex(const QString& key)
+{
+    for (size_t i = 0; i < JoinStateStrings.size(); ++i)
+        if (key == QLatin1String(JoinStateStrings[i]))
+            return int(i);
+    return -1;
+}
+
+struct SyncStreamParser::DecodedRoom {
+    QString roomId;
+    JoinState joinState;
+    std::optional<SyncRoomData> data {};
+    QString error {};
+    QFuture<void> decoding {};
+};
+
+bool SyncStreamParser::feed(const QByteArray& chunk)
+{
+    if (!error.isEmpty())
+        return false;
+
+    buffer.append(chunk);
+    const auto* const bytes = buffer.constData();
+    const auto size = buffer.size();
+    // UTF-8 sequences never contain ASCII bytes, so scanning byte by byte
+    // for JSON structural characters is safe.
+    while (pos < size) {
+        const auto c = bytes[pos];
+        if (inString) {
+            if (escaped)
+                escaped = false;
+            else if (c == '\\')
+                escaped = true;
+            else if (c == '"') {
+                inString = false;
+                if (inKey) {
+                    auto& frame = frames.back();
+                    frame.expectsKey = false;
+                    // Keys are only needed down to room ids
+                    if (frames.size() <= 3) {
+                        const auto keyJson = QByteArray::fromRawData(
+                            bytes + tokenStart, pos + 1 - tokenStart);
+                        frame.key =
+                            keyJson.contains('\\')
+                                ? parseJsonValue(keyJson, nullptr).toString()
+                                : QString::fromUtf8(keyJson.mid(
+                                    1, keyJson.size() - 2));
+                    }
+                } else if (!valueFinished(pos + 1))
+                    return false;
+            }
+            ++pos;
+            continue;
+        }
+        if (inLiteral) {
+            if (isLiteralChar(c)) {
+                ++pos;
+                continue;
+            }
+            inLiteral = false;
+            if (!valueFinished(pos))
+                return false;
+            // Fall through to process the character after the literal
+        }
+        switch (c) {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+            break;
+        case '{':
+        case '[':
+            if (!valueStarted(pos))
+                return false;
+            frames.push_back({ c == '{', c == '{', {} });
+            break;
+        case '}':
+        case ']':
+            if (frames.empty() || frames.back().isObject != (c == '}'))
+                return fail(QStringLiteral("Unbalanced '%1'").arg(c));
+            frames.pop_back();
+            if (!valueFinished(pos + 1))
+                return false;
+            break;
+        case ',':
+            if (frames.empty())
+                return fail(QStringLiteral("Unexpected ','"));
+            if (frames.back().isObject)
+                frames.back().expectsKey = true;
+            break;
+        case ':':
+            if (frames.empty() || !frames.back().isObject
+                || frames.back().expectsKey)
+                return fail(QStringLiteral("Unexpected ':'"));
+            break;
+        case '"':
+            inKey = !frames.empty() && frames.back().isObject
+                    && frames.back().expectsKey;
+            if (!inKey && !valueStarted(pos))
+                return false;
+            inString = true;
+            tokenStart = pos;
+            break;
+        default:
+            if (!isLiteralChar(c))
+                return fail(QStringLiteral("Unexpected character '%1'").arg(c));
+            if (!valueStarted(pos))
+                return false;
+            inLiteral = true;
+            tokenStart = pos;
+        }
+        ++pos;
+    }
+
+    // Drop what has been consumed and won't be needed anymore; only once
+    // it is most of the buffer, so that the rest is not moved on every chunk
+    auto keepFrom = pos;
+    if (inString || inLiteral)
+        keepFrom = std::min(keepFrom, tokenStart);
+    if (captureStart >= 0)
+        keepFrom = std::min(keepFrom, captureStart);
+    if (keepFrom > 0 && keepFrom >= buffer.size() / 2) {
+        buffer.remove(0, keepFrom);
+        pos -= keepFrom;
+        tokenStart -= keepFrom;
+        if (captureStart >= 0)
+            captureStart -= keepFrom;
+    }
+    return true;
+}
+
+bool SyncStreamParser::finish()
+{
+    if (!error.isEmpty())
+        return false;
+    if (!rootDone || inString || inLiteral)
+        return fail(QStringLiteral("Incomplete JSON"));
+
+    for (const auto& room : rooms) {
+        room->decoding.waitForFinished();
+        if (!room->error.isEmpty())
+            return fail(room->error);
+        if (room->data)
+            data.roomData.emplace_back(std::move(*room->data));
+    }
+    rooms.clear();
+    data.parseJson(topLevelJson);
+    topLevelJson = {};
+    return true;
+}
+
+bool SyncStreamParser::valueStarted(int at)
+{
+    if (rootDone)
+        return fail(QStringLiteral("Unexpected data after the JSON object"));
+    if (frames.empty()) {
+        if (buffer.at(at) != '{')
+            return fail(QStringLiteral("The response is not a JSON object"));
+        return true;
+    }
+    if (captureStart >= 0)
+        return true; // Already inside a captured subtree
+
+    // Capture every top-level value except "rooms", and each room
+    // under rooms.join/invite/leave
+    const auto& topKey = frames.front().key;
+    if ((frames.size() == 1 && topKey != "rooms"_ls)
+        || (frames.size() == 3 && topKey == "rooms"_ls && frames[1].isObject
+            && frames[2].isObject && joinStateIndex(frames[1].key) != -1)) {
+        captureStart = at;
+        captureDepth = frames.size();
+    }
+    return true;
+}
+
+bool SyncStreamParser::valueFinished(int end)
+{
+    if (frames.empty()) {
+        rootDone = true;
+        return true;
+    }
+    if (captureStart < 0 || frames.size() != captureDepth)
+        return true;
+
+    const auto json = QByteArray::fromRawData(buffer.constData() + captureStart,
+                                              end - captureStart);
+    captureStart = -1;
+    if (captureDepth == 1) {
+        QJsonParseError parseError { 0, QJsonParseError::NoError };
+        const auto value = parseJsonValue(json, &parseError);
+        if (parseError.error != QJsonParseError::NoError)
+            return fail(parseError.errorString());
+        topLevelJson.insert(frames.front().key, value);
+        return true;
+    }
+
+    // The room is parsed and decoded off the thread that receives
+    // the response; the buffer keeps changing, hence a copy of the JSON
+    const auto& room = rooms.emplace_back(std::make_shared<DecodedRoom>(
+        DecodedRoom { frames[2].key,
+                      JoinState(1u << joinStateIndex(frames[1].key)) }));
+    room->decoding = QtConcurrent::run(
+        [room, json = QByteArray(json.constData(), json.size())] {
+            QJsonParseError parseError { 0, QJsonParseError::NoError };
+            const auto value = parseJsonValue(json, &parseError);
+            if (parseError.error != QJsonParseError::NoError)
+                room->error = parseError.errorString();
+            else if (value.isObject())
+                room->data.emplace(room->roomId, room->joinState,
+                                   value.toObject());
+            else
+                qCWarning(SYNCJOB) << "Room" << room->roomId
+                                   << "data in the response is not an object";
+        });
+    return true;
+}
+
+bool SyncStreamParser::fail(const QString& message)
+{
+    error = message;
+    qCWarning(SYNCJOB).noquote() << "Malformed sync response:" << message;
+    return false;
+}
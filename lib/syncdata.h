@@ -80,8 +80,24 @@ using SyncDataList = std::vector<SyncRoomData>;
 
 class SyncData {
 public:
+    /// Formats of the state cache files
+    /** Files in any of these formats can be loaded, no matter which
+     * format is used for saving.
+     */
+    enum class CacheFormat {
+        Json, //< Compact JSON text
+        QtBinary, //< QJsonDocument::toBinaryData()
+        Records //< A header and length-prefixed records, see encodeCache()
+    };
+
     SyncData() = default;
-    explicit SyncData(const QString& cacheFileName);
+    /// Load the state cache
+    /// \param cacheFileName the top-level state cache file
+    /// \param skipIndexedRooms if true, joined rooms that have an entry in
+    ///        the room index (see roomIndex()) are not loaded from their
+    ///        cache files; it's up to the caller to load them when needed
+    explicit SyncData(const QString& cacheFileName,
+                      bool skipIndexedRooms = false);
     /** Parse sync response into room events
      * \param json response from /sync or a room state cache
      * \return the list of rooms with missing cache files; always
@@ -96,19 +112,107 @@ public:
 
     QString nextBatch() const { return nextBatch_; }
 
+    /// The sync filter id and definition stored with the state cache
+    QJsonObject syncFilter() const { return syncFilter_; }
+
+    /// The compact index of joined rooms stored with the state cache
+    /** Each entry maps a room id to a room object in the /sync format,
+     * with only the summary, the tags, the unread counters and (as an
+     * extension) the display name of the room.
+     */
+    QJsonObject roomIndex() const { return roomIndex_; }
+
     QStringList unresolvedRooms() const { return unresolvedRoomIds; }
 
-    static std::pair<int, int> cacheVersion() { return { 10, 0 }; }
+    /// The format of the top-level state cache file that has been loaded
+    CacheFormat cacheFormat() const { return cacheFormat_; }
+
+    static std::pair<int, int> cacheVersion() { return { 10, 1 }; }
     static QString fileNameForRoom(QString roomId);
 
+    /// Load a state cache file, detecting its format by the contents
+    static QJsonObject loadJson(const QString& fileName,
+                                CacheFormat* format = nullptr);
+    /// Serialise a state cache object to the given format
+    /** With CacheFormat::Records, the data start with a header carrying
+     * a magic number and cacheVersion(). Each `events` array found in
+     * the top-level members of the object is written as a series of
+     * records, one per event; the rest of the object goes to a single
+     * skeleton record, followed by an index record with the location of
+     * each series. Every record is prefixed with its size so that it can
+     * be skipped without parsing; readers skip record types they don't
+     * know. Payloads are in CBOR, decoded straight into JSON objects.
+     */
+    static QByteArray encodeCache(const QJsonObject& json, CacheFormat format);
+
+    static const QString SyncFilterKey;
+    static const QString RoomIndexKey;
+
 private:
     QString nextBatch_;
+    QJsonObject syncFilter_;
+    QJsonObject roomIndex_;
+    bool skipIndexedRooms = false;
+    CacheFormat cacheFormat_ = CacheFormat::Json;
     Events presenceData;
     Events accountData;
     Events toDeviceEvents;
     SyncDataList roomData;
     QStringList unresolvedRoomIds;
 
-    static QJsonObject loadJson(const QString& fileName);
+    friend class SyncStreamParser;
+};
+
+/// Incremental decoder of /sync responses
+/**
+ * Instead of building a single QJsonDocument for the whole response, this
+ * class scans the response body as it arrives; as soon as the JSON subtree
+ * of a room is complete, the room is decoded into SyncRoomData on a worker
+ * thread, while the rest of the response is being received. Only the
+ * subtrees of the rooms being decoded are held as JSON documents. The
+ * remaining top-level entries (next_batch, account_data etc.) are
+ * comparatively small and are decoded by finish(), which also waits for
+ * the rooms.
+ */
+class SyncStreamParser {
+public:
+    /// Feed the next chunk of the response body
+    /// \return false if the data fed so far is malformed
+    bool feed(const QByteArray& chunk);
+    /// Complete decoding after the last chunk has been fed
+    /// \return false if the response is malformed or incomplete
+    bool finish();
+
+    QString errorString() const { return error; }
+    SyncData&& takeData() { return std::move(data); }
+
+private:
+    struct Frame {
+        bool isObject;
+        bool expectsKey;
+        QString key;
+    };
+    struct DecodedRoom;
+
+    SyncData data;
+    QJsonObject topLevelJson;
+    /// Rooms in the order of the response, possibly still being decoded
+    std::vector<std::shared_ptr<DecodedRoom>> rooms;
+    QByteArray buffer; //< The body from the first byte that is still needed
+    int pos = 0; //< The next byte to scan in the buffer
+    int tokenStart = -1; //< Where the current string or literal starts
+    int captureStart = -1; //< Where the captured room/entry starts
+    size_t captureDepth = 0;
+    std::vector<Frame> frames;
+    bool inString = false;
+    bool inKey = false;
+    bool escaped = false;
+    bool inLiteral = false;
+    bool rootDone = false;
+    QString error;
+
+    bool valueStarted(int at);
+    bool valueFinished(int end);
+    bool fail(const QString& message);
 };
 } // namespace Quotient
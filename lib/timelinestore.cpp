@@ -0,0 +1,412 @@
+/******************************************************************************
+ * Copyright (C) 2020 Quotient project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "timelinestore.h"
+
+#include "logging.h"
+
+#include "events/eventloader.h"
+
+#include <QtCore/QJsonDocument>
+#include <QtCore/QSaveFile>
+#include <QtCore/QtEndian>
+
+#include <algorithm>
+#include <utility>
+
+using namespace Quotient;
+
+static const auto StoreMagic = QByteArrayLiteral("QTLS");
+static constexpr quint16 StoreVersion = 1;
+static constexpr int StoreHeaderSize = 8; // Magic, version, reserved
+// Record size (4 bytes), type (1 byte) and key size (2 bytes)
+static constexpr int RecordHeaderSize = 7;
+
+static QByteArray storeHeader()
+{
+    QByteArray header = StoreMagic;
+    header.resize(StoreHeaderSize);
+    qToBigEndian<quint16>(StoreVersion, header.data() + StoreMagic.size());
+    qToBigEndian<quint16>(0, header.data() + StoreMagic.size() + 2);
+    return header;
+}
+
+TimelineStore::TimelineStore(const QString& fileName) : file(fileName) {}
+
+QString TimelineStore::fileNameForRoom(QString roomId)
+{
+    roomId.replace(':', '_');
+    return roomId + ".timeline";
+}
+
+bool TimelineStore::open()
+{
+    if (opened)
+        return file.isOpen();
+    opened = true;
+    if (!file.open(QIODevice::ReadWrite)) {
+        qCWarning(MAIN) << "Failed to open timeline store" << file.fileName()
+                        << ":" << file.errorString();
+        return false;
+    }
+    if (file.read(StoreHeaderSize) != storeHeader()) {
+        if (file.size() > 0)
+            qCWarning(MAIN) << "Timeline store" << file.fileName()
+                            << "has unknown format, discarding";
+        file.resize(0);
+        file.write(storeHeader());
+        fileSize = StoreHeaderSize;
+        return true;
+    }
+
+    // Only the record headers and keys are read here; the payloads are
+    // skipped until the events are loaded
+    qint64 pos = StoreHeaderSize;
+    while (pos < file.size()) {
+        file.seek(pos);
+        const auto recordHeader = file.read(RecordHeaderSize);
+        if (recordHeader.size() < RecordHeaderSize)
+            break;
+        const auto size = qFromBigEndian<quint32>(recordHeader.constData());
+        const auto type = quint8(recordHeader[4]);
+        const auto keySize =
+            qFromBigEndian<quint16>(recordHeader.constData() + 5);
+        if (size < 3u + keySize || pos + 4 + size > file.size())
+            break;
+        const auto key = QString::fromUtf8(file.read(keySize));
+        const auto payloadOffset = pos + RecordHeaderSize + keySize;
+        const auto payloadSize = int(size - 3 - keySize);
+        switch (type) {
+        case NewerEventRecord:
+        case OlderEventRecord:
+            placeEvent(RecordType(type), key, { payloadOffset, payloadSize });
+            break;
+        case InsertedEventRecord: {
+            const auto prefix = file.read(2);
+            if (prefix.size() < 2)
+                break;
+            const auto beforeIdSize =
+                qFromBigEndian<quint16>(prefix.constData());
+            if (payloadSize < 2 + beforeIdSize)
+                break;
+            const auto beforeId = QString::fromUtf8(file.read(beforeIdSize));
+            placeEvent(InsertedEventRecord, key,
+                       { payloadOffset + 2 + beforeIdSize,
+                         payloadSize - 2 - beforeIdSize },
+                       beforeId);
+            break;
+        }
+        case GapRecord:
+            if (index.contains(key)) {
+                const auto token = QString::fromUtf8(file.read(payloadSize));
+                if (token.isEmpty())
+                    gapTokens.remove(key);
+                else
+                    gapTokens.insert(key, token);
+            }
+            break;
+        case EventUpdateRecord:
+            if (auto it = index.find(key); it != index.end()) {
+                it->offset = payloadOffset;
+                it->size = payloadSize;
+            }
+            break;
+        case PrevBatchRecord:
+            prevBatch_ = key;
+            break;
+        default:; // Unknown records are skipped
+        }
+        ++recordCount;
+        pos += 4 + size;
+    }
+    if (pos < file.size()) {
+        // Most likely, the client was stopped in the middle of a write
+        qCWarning(MAIN) << "Timeline store" << file.fileName()
+                        << "is truncated at" << pos;
+        file.resize(pos);
+    }
+    fileSize = pos;
+    compactIfNeeded();
+    return file.isOpen();
+}
+
+bool TimelineStore::placeEvent(RecordType type, const QString& eventId,
+                               Location location, const QString& beforeId)
+{
+    if (index.contains(eventId))
+        return false;
+    switch (type) {
+    case NewerEventRecord:
+        location.olderId = newestId;
+        (newestId.isEmpty() ? oldestId : index[newestId].newerId) = eventId;
+        newestId = eventId;
+        break;
+    case OlderEventRecord:
+        location.newerId = oldestId;
+        (oldestId.isEmpty() ? newestId : index[oldestId].olderId) = eventId;
+        oldestId = eventId;
+        break;
+    case InsertedEventRecord: {
+        const auto it = index.find(beforeId);
+        if (it == index.end())
+            return false;
+        location.newerId = beforeId;
+        location.olderId = std::exchange(it->olderId, eventId);
+        (location.olderId.isEmpty() ? oldestId
+                                    : index[location.olderId].newerId) =
+            eventId;
+        break;
+    }
+    default:
+        return false;
+    }
+    index.insert(eventId, location);
+    return true;
+}
+
+qint64 TimelineStore::addRecord(RecordType type, const QString& key,
+                                const QByteArray& payload)
+{
+    const auto keyUtf8 = key.toUtf8();
+    const auto start = pendingRecords.size();
+    pendingRecords.resize(start + RecordHeaderSize);
+    qToBigEndian<quint32>(quint32(3 + keyUtf8.size() + payload.size()),
+                          pendingRecords.data() + start);
+    pendingRecords[start + 4] = char(type);
+    qToBigEndian<quint16>(quint16(keyUtf8.size()),
+                          pendingRecords.data() + start + 5);
+    pendingRecords.append(keyUtf8).append(payload);
+    ++recordCount;
+    return fileSize + pendingRecords.size() - payload.size();
+}
+
+bool TimelineStore::isEmpty() { return !open() || index.isEmpty(); }
+
+bool TimelineStore::contains(const QString& eventId)
+{
+    return open() && index.contains(eventId);
+}
+
+QString TimelineStore::oldestEventId()
+{
+    return open() ? oldestId : QString();
+}
+
+QString TimelineStore::prevBatch()
+{
+    open();
+    return prevBatch_;
+}
+
+QString TimelineStore::gapBefore(const QString& eventId)
+{
+    return open() ? gapTokens.value(eventId) : QString();
+}
+
+static QByteArray eventPayload(const RoomEvent& evt)
+{
+    return QJsonDocument(evt.fullJson()).toJson(QJsonDocument::Compact);
+}
+
+void TimelineStore::addNewerEvent(const RoomEvent& evt)
+{
+    if (!open() || index.contains(evt.id()))
+        return;
+    const auto payload = eventPayload(evt);
+    placeEvent(NewerEventRecord, evt.id(),
+               { addRecord(NewerEventRecord, evt.id(), payload),
+                 payload.size() });
+}
+
+void TimelineStore::addOlderEvent(const RoomEvent& evt)
+{
+    if (!open() || index.contains(evt.id()))
+        return;
+    const auto payload = eventPayload(evt);
+    placeEvent(OlderEventRecord, evt.id(),
+               { addRecord(OlderEventRecord, evt.id(), payload),
+                 payload.size() });
+}
+
+void TimelineStore::insertEventBefore(const QString& beforeId,
+                                      const RoomEvent& evt)
+{
+    if (!open() || index.contains(evt.id()) || !index.contains(beforeId))
+        return;
+    const auto beforeIdUtf8 = beforeId.toUtf8();
+    QByteArray prefix(2, '\0');
+    qToBigEndian<quint16>(quint16(beforeIdUtf8.size()), prefix.data());
+    prefix.append(beforeIdUtf8);
+    const auto payload = eventPayload(evt);
+    const auto offset =
+        addRecord(InsertedEventRecord, evt.id(), prefix + payload);
+    placeEvent(InsertedEventRecord, evt.id(),
+               { offset + prefix.size(), payload.size() }, beforeId);
+}
+
+void TimelineStore::updateEvent(const RoomEvent& evt)
+{
+    if (!open() || !index.contains(evt.id()))
+        return;
+    const auto payload = eventPayload(evt);
+    const auto offset = addRecord(EventUpdateRecord, evt.id(), payload);
+    auto& location = index[evt.id()];
+    location.offset = offset;
+    location.size = payload.size();
+}
+
+void TimelineStore::setPrevBatch(const QString& token)
+{
+    if (!open() || token == prevBatch_)
+        return;
+    prevBatch_ = token;
+    addRecord(PrevBatchRecord, token);
+}
+
+void TimelineStore::setGapBefore(const QString& eventId, const QString& token)
+{
+    if (!open() || !index.contains(eventId)
+        || gapTokens.value(eventId) == token)
+        return;
+    if (token.isEmpty())
+        gapTokens.remove(eventId);
+    else
+        gapTokens.insert(eventId, token);
+    addRecord(GapRecord, eventId, token.toUtf8());
+}
+
+void TimelineStore::flush()
+{
+    if (pendingRecords.isEmpty() || !open())
+        return;
+    file.seek(fileSize);
+    if (file.write(pendingRecords) != pendingRecords.size() || !file.flush()) {
+        qCWarning(MAIN) << "Failed to write to timeline store"
+                        << file.fileName() << ":" << file.errorString();
+        // Make sure the next opening doesn't see a half-written record
+        file.resize(fileSize);
+    } else
+        fileSize += pendingRecords.size();
+    pendingRecords.clear();
+    compactIfNeeded();
+}
+
+void TimelineStore::compactIfNeeded()
+{
+    const auto liveCount =
+        index.size() + int(!prevBatch_.isEmpty()) + gapTokens.size();
+    if (recordCount - liveCount <= liveCount || !pendingRecords.isEmpty())
+        return;
+
+    // Re-add the live records as if the file only had the header, with
+    // the events appended from the oldest to the newest
+    const auto oldIndex = std::exchange(index, {});
+    const auto oldOldestId = std::exchange(oldestId, {});
+    const auto oldNewestId = std::exchange(newestId, {});
+    const auto oldFileSize = std::exchange(fileSize, StoreHeaderSize);
+    const auto oldRecordCount = std::exchange(recordCount, 0);
+    for (auto id = oldOldestId; !id.isEmpty();) {
+        const auto location = oldIndex.value(id);
+        file.seek(location.offset);
+        const auto payload = file.read(location.size);
+        placeEvent(NewerEventRecord, id,
+                   { addRecord(NewerEventRecord, id, payload),
+                     payload.size() });
+        id = location.newerId;
+    }
+    if (!prevBatch_.isEmpty())
+        addRecord(PrevBatchRecord, prevBatch_);
+    for (auto it = gapTokens.cbegin(); it != gapTokens.cend(); ++it)
+        addRecord(GapRecord, it.key(), it.value().toUtf8());
+
+    QSaveFile newFile { file.fileName() };
+    if (!newFile.open(QIODevice::WriteOnly)
+        || newFile.write(storeHeader()) != StoreHeaderSize
+        || newFile.write(pendingRecords) != pendingRecords.size()
+        || !newFile.commit()) {
+        qCWarning(MAIN) << "Failed to compact timeline store"
+                        << file.fileName() << ":" << newFile.errorString();
+        index = oldIndex;
+        oldestId = oldOldestId;
+        newestId = oldNewestId;
+        fileSize = oldFileSize;
+        recordCount = oldRecordCount;
+        pendingRecords.clear();
+        return;
+    }
+    qCDebug(MAIN) << "Compacted timeline store" << file.fileName() << "from"
+                  << oldFileSize << "to" << fileSize + pendingRecords.size()
+                  << "bytes";
+    fileSize += pendingRecords.size();
+    pendingRecords.clear();
+    // The file has been replaced; reopen it for subsequent writes
+    file.close();
+    if (!file.open(QIODevice::ReadWrite))
+        qCWarning(MAIN) << "Failed to reopen timeline store"
+                        << file.fileName() << ":" << file.errorString();
+}
+
+RoomEventPtr TimelineStore::loadEvent(const Location& location)
+{
+    file.seek(location.offset);
+    return Quotient::loadEvent<RoomEvent>(
+        QJsonDocument::fromJson(file.read(location.size)).object());
+}
+
+RoomEvents TimelineStore::loadEventsBefore(const QString& eventId, int limit)
+{
+    RoomEvents events;
+    if (!open())
+        return events;
+    flush();
+
+    auto id = newestId;
+    if (!eventId.isEmpty()) {
+        const auto it = index.constFind(eventId);
+        if (it == index.cend())
+            return events;
+        id = it->olderId;
+    }
+    for (int i = 0; i < limit && !id.isEmpty(); ++i) {
+        const auto location = index.value(id);
+        if (auto e = loadEvent(location); e && e->id() == id)
+            events.emplace_back(std::move(e));
+        else
+            qCWarning(MAIN) << "Timeline store" << file.fileName()
+                            << "has a broken record for" << id;
+        id = location.olderId;
+    }
+    return events;
+}
+
+void TimelineStore::clear()
+{
+    file.close();
+    if (file.exists() && !file.remove())
+        qCWarning(MAIN) << "Failed to remove timeline store" << file.fileName()
+                        << ":" << file.errorString();
+    opened = false;
+    fileSize = 0;
+    recordCount = 0;
+    pendingRecords.clear();
+    index.clear();
+    oldestId.clear();
+    newestId.clear();
+    prevBatch_.clear();
+    gapTokens.clear();
+}
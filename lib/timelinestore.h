@@ -0,0 +1,129 @@
+/******************************************************************************
+ * Copyright (C) 2020 Quotient project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#pragma once
+
+#include "events/roomevent.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+
+namespace Quotient {
+/// Append-only on-disk storage of a room timeline
+/**
+ * The store is a file with a sequence of size-prefixed records, each
+ * carrying an event or a pagination token. Events added at either end
+ * of the timeline or inserted in the middle of it (e.g. when a gap is
+ * filled) are recorded as they come; a later record for the same event
+ * (e.g. after a redaction) supersedes the earlier ones. Gaps, i.e. places
+ * where the server skipped events, are recorded along with the tokens to
+ * fill them, so that events before and after a gap are not glued together
+ * when loaded. Opening the store only reads the record headers to build
+ * an index of events; the JSON of events is only parsed when they are
+ * loaded. Once superseded records outnumber the live ones, the file is
+ * rewritten with only the live records.
+ */
+class TimelineStore {
+public:
+    explicit TimelineStore(const QString& fileName);
+
+    bool isEmpty();
+    bool contains(const QString& eventId);
+    QString oldestEventId();
+    /// The token to paginate back from the oldest stored event
+    QString prevBatch();
+    /// The token to fill the gap right before the event, if there's a gap
+    QString gapBefore(const QString& eventId);
+    /// Load stored events preceding the given one
+    /** \param eventId the event to start from; if empty, the newest
+     *         stored events are loaded
+     *  \param limit the maximum number of events to load
+     *  \return the events, from the newest to the oldest; empty if
+     *          the event is not in the store
+     */
+    RoomEvents loadEventsBefore(const QString& eventId, int limit);
+
+    /// Record an event added at the newer end of the timeline
+    void addNewerEvent(const RoomEvent& evt);
+    /// Record an event added at the older end of the timeline
+    void addOlderEvent(const RoomEvent& evt);
+    /// Record an event inserted right before a stored event
+    /** Does nothing if the event with \p beforeId is not in the store. */
+    void insertEventBefore(const QString& beforeId, const RoomEvent& evt);
+    /// Record a new version of a stored event
+    void updateEvent(const RoomEvent& evt);
+    void setPrevBatch(const QString& token);
+    /// Record a gap right before a stored event
+    /** \param token the token to fill the gap; an empty token means
+     *         there's no gap anymore
+     */
+    void setGapBefore(const QString& eventId, const QString& token);
+    /// Write the records added since the last flush to the file
+    void flush();
+    /// Remove all events and the file
+    void clear();
+
+    static QString fileNameForRoom(QString roomId);
+
+private:
+    enum RecordType : quint8 {
+        NewerEventRecord = 1,
+        OlderEventRecord = 2,
+        EventUpdateRecord = 3,
+        PrevBatchRecord = 4,
+        /// The payload starts with the id of the event this one goes before
+        InsertedEventRecord = 5,
+        /// A gap before the event, with the token in the payload
+        GapRecord = 6
+    };
+    struct Location {
+        qint64 offset;
+        int size;
+        // The neighbours in the timeline; empty at the ends
+        QString olderId {};
+        QString newerId {};
+    };
+
+    QFile file;
+    bool opened = false;
+    qint64 fileSize = 0; //< The size of the file after flushing
+    QByteArray pendingRecords;
+    /// The location of the latest JSON of each stored event
+    QHash<QString, Location> index;
+    QString oldestId;
+    QString newestId;
+    QString prevBatch_;
+    /// Tokens to fill the gaps, by the id of the event right after each gap
+    QHash<QString, QString> gapTokens;
+    int recordCount = 0; //< All records, including the superseded ones
+
+    bool open();
+    /// Rewrite the file if superseded records outnumber the live ones
+    void compactIfNeeded();
+    RoomEventPtr loadEvent(const Location& location);
+    /// Put an event in the timeline order, according to the record type
+    /** \param beforeId the event to insert before, for InsertedEventRecord
+     *  \return false if the event can't be placed
+     */
+    bool placeEvent(RecordType type, const QString& eventId,
+                    Location location, const QString& beforeId = {});
+    /// \return the offset of the payload in the file
+    qint64 addRecord(RecordType type, const QString& key,
+                     const QByteArray& payload = {});
+};
+} // namespace Quotient
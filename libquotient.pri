@@ -1,4 +1,4 @@
-QT += network multimedia
+QT += concurrent network multimedia
 # TODO: Having moved to Qt 5.12, replace c++1z with c++17 below
 CONFIG *= c++1z warn_on rtti_off create_prl object_parallel_to_source
 
@@ -22,6 +22,7 @@ HEADERS += \
     $$SRCPATH/user.h \
     $$SRCPATH/avatar.h \
     $$SRCPATH/syncdata.h \
+    $$SRCPATH/timelinestore.h \
     $$SRCPATH/util.h \
     $$SRCPATH/qt_connection_util.h \
     $$SRCPATH/events/event.h \
@@ -73,6 +74,7 @@ SOURCES += \
     $$SRCPATH/user.cpp \
     $$SRCPATH/avatar.cpp \
     $$SRCPATH/syncdata.cpp \
+    $$SRCPATH/timelinestore.cpp \
     $$SRCPATH/util.cpp \
     $$SRCPATH/events/event.cpp \
     $$SRCPATH/events/roomevent.cpp \
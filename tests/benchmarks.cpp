@@ -0,0 +1,327 @@
+#include "connection.h"
+#include "room.h"
+#include "syncdata.h"
+
+#include "events/eventloader.h"
+
+#include <QtCore/QTemporaryDir>
+#include <QtTest/QtTest>
+
+#include <algorithm>
+#include <random>
+
+using namespace Quotient;
+
+/// Synthetic data in the shape of /sync responses
+namespace {
+QJsonObject makeMessage(const QString& roomId, int n)
+{
+    return { { "type", "m.room.message" },
+             { "event_id", QStringLiteral("$%1-%2").arg(roomId).arg(n) },
+             { "sender", QStringLiteral("@user%1:example.org").arg(n % 7) },
+             { "origin_server_ts", 1500000000000 + n },
+             { "content", QJsonObject { { "msgtype", "m.text" },
+                                        { "body", QStringLiteral(
+                                                      "Message %1")
+                                                      .arg(n) } } } };
+}
+
+QJsonObject makeMember(const QString& roomId, int n)
+{
+    const auto userId = QStringLiteral("@user%1:example.org").arg(n);
+    return { { "type", "m.room.member" },
+             { "event_id", QStringLiteral("$%1-m%2").arg(roomId).arg(n) },
+             { "sender", userId },
+             { "state_key", userId },
+             { "origin_server_ts", 1500000000000 + n },
+             { "content", QJsonObject { { "membership", "join" },
+                                        { "displayname",
+                                          QStringLiteral("User %1")
+                                              .arg(n) } } } };
+}
+
+QJsonObject makeSyncBatch(int rooms, int stateEvents, int timelineEvents)
+{
+    QJsonObject joinedRooms;
+    for (int r = 0; r < rooms; ++r) {
+        const auto roomId = QStringLiteral("!room%1:example.org").arg(r);
+        QJsonArray state;
+        for (int i = 0; i < stateEvents; ++i)
+            state.append(makeMember(roomId, i));
+        QJsonArray timeline;
+        for (int i = 0; i < timelineEvents; ++i)
+            timeline.append(makeMessage(roomId, i));
+        joinedRooms.insert(
+            roomId, QJsonObject { { "state", QJsonObject { { "events", state } } },
+                                  { "timeline", QJsonObject {
+                                                    { "events", timeline } } } });
+    }
+    return { { "next_batch", "s1" },
+             { "rooms", QJsonObject { { "join", joinedRooms } } } };
+}
+
+/// A room state cache as saved by Room::toJson()
+QJsonObject makeRoomCache(const QString& roomId, int members)
+{
+    QJsonArray state;
+    for (int i = 0; i < members; ++i)
+        state.append(makeMember(roomId, i));
+    QJsonArray accountData;
+    for (int i = 0; i < 5; ++i)
+        accountData.append(QJsonObject {
+            { "type", QStringLiteral("org.example.data%1").arg(i) },
+            { "content", QJsonObject { { "value", i } } } });
+    return { { "state", QJsonObject { { "events", state } } },
+             { "account_data", QJsonObject { { "events", accountData } } },
+             { "unread_notifications",
+               QJsonObject { { SyncRoomData::UnreadCountKey, 3 } } } };
+}
+} // namespace
+
+Q_DECLARE_METATYPE(SyncData::CacheFormat)
+
+/// Gives access to Room::updateData() for feeding sync data directly
+class BenchmarkRoom : public Room {
+public:
+    using Room::Room;
+    using Room::updateData;
+};
+
+class Benchmarks : public QObject {
+    Q_OBJECT
+private slots:
+    void decodeSyncBatch_data();
+    void decodeSyncBatch();
+    void arenaRetainedMemory_data();
+    void arenaRetainedMemory();
+    void loadStateCache_data();
+    void loadStateCache();
+    void addEventsWithDuplicates_data();
+    void addEventsWithDuplicates();
+    void applyMemberState_data();
+    void applyMemberState();
+    void loadEventMix();
+};
+
+void Benchmarks::decodeSyncBatch_data()
+{
+    QTest::addColumn<bool>("arena");
+    QTest::newRow("malloc") << false;
+    QTest::newRow("arena") << true;
+}
+
+void Benchmarks::decodeSyncBatch()
+{
+    QFETCH(bool, arena);
+    EventArenaScope::setEnabled(arena);
+    const auto json = makeSyncBatch(200, 5, 20);
+    QBENCHMARK {
+        SyncData data;
+        data.parseJson(json);
+    }
+    EventArenaScope::setEnabled(false);
+}
+
+void Benchmarks::arenaRetainedMemory_data()
+{
+    QTest::addColumn<int>("timelineEvents");
+    QTest::newRow("1 event per room") << 1;
+    QTest::newRow("10 events per room") << 10;
+    QTest::newRow("50 events per room") << 50;
+    QTest::newRow("500 events per room") << 500;
+}
+
+void Benchmarks::arenaRetainedMemory()
+{
+    // The worst case for an arena: of all events in each room, only
+    // the newest one stays around (e.g. with a small timeline limit)
+    QFETCH(int, timelineEvents);
+    static constexpr int Rooms = 1000;
+    EventArenaScope::setEnabled(true);
+    const auto bytesBefore = EventArenaScope::allocatedBytes();
+    std::vector<RoomEventPtr> survivors;
+    {
+        SyncData data;
+        data.parseJson(makeSyncBatch(Rooms, 5, timelineEvents));
+        for (auto& rd : data.takeRoomData()) {
+            QVERIFY(rd.state.empty()
+                    || !EventArenaScope::isInArena(rd.state.front().get()));
+            survivors.emplace_back(std::move(rd.timeline.back()));
+        }
+    }
+    EventArenaScope::setEnabled(false);
+    const auto retained = EventArenaScope::allocatedBytes() - bytesBefore;
+    QTest::setBenchmarkResult(qreal(retained) / Rooms, QTest::BytesAllocated);
+    survivors.clear();
+    QCOMPARE(EventArenaScope::allocatedBytes(), bytesBefore);
+}
+
+void Benchmarks::loadStateCache_data()
+{
+    QTest::addColumn<SyncData::CacheFormat>("format");
+    QTest::addColumn<int>("members");
+    for (auto members : { 10, 1000 }) {
+        const auto suffix = QStringLiteral(", %1 members").arg(members);
+        QTest::newRow(qPrintable("json" + suffix))
+            << SyncData::CacheFormat::Json << members;
+        QTest::newRow(qPrintable("Qt binary" + suffix))
+            << SyncData::CacheFormat::QtBinary << members;
+        QTest::newRow(qPrintable("records" + suffix))
+            << SyncData::CacheFormat::Records << members;
+    }
+}
+
+void Benchmarks::loadStateCache()
+{
+    QFETCH(SyncData::CacheFormat, format);
+    QFETCH(int, members);
+    const auto roomId = QStringLiteral("!room:example.org");
+    const auto cacheJson = makeRoomCache(roomId, members);
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const auto fileName = dir.filePath(SyncData::fileNameForRoom(roomId));
+    QFile file { fileName };
+    QVERIFY(file.open(QFile::WriteOnly));
+    file.write(SyncData::encodeCache(cacheJson, format));
+    file.close();
+
+    SyncData::CacheFormat loadedFormat;
+    QCOMPARE(SyncData::loadJson(fileName, &loadedFormat), cacheJson);
+    QCOMPARE(loadedFormat, format);
+    // What Connection::loadState() does with a room cache file
+    QBENCHMARK {
+        const SyncRoomData roomData(roomId, JoinState::Join,
+                                    SyncData::loadJson(fileName));
+        QCOMPARE(int(roomData.state.size()), members);
+    }
+}
+
+void Benchmarks::addEventsWithDuplicates_data()
+{
+    QTest::addColumn<int>("batchSize");
+    for (auto size : { 10, 100, 1000, 10000 })
+        QTest::newRow(qPrintable(QStringLiteral("%1 events").arg(size)))
+            << size;
+}
+
+void Benchmarks::addEventsWithDuplicates()
+{
+    // A batch where the first half is already in the timeline and every
+    // tenth event is repeated; the room processing, deduplication included,
+    // should take time linear in the batch size. Only updateData() is
+    // timed, so the rooms and the events are made outside of QBENCHMARK.
+    QFETCH(int, batchSize);
+    const auto roomId = QStringLiteral("!room:example.org");
+    const auto makeTimeline = [&roomId](int from, int to, bool withRepeats) {
+        QJsonArray events;
+        for (int i = from; i < to; ++i) {
+            events.append(makeMessage(roomId, i));
+            if (withRepeats && i % 10 == 0)
+                events.append(makeMessage(roomId, i));
+        }
+        return QJsonObject {
+            { "timeline", QJsonObject { { "events", events } } }
+        };
+    };
+    const auto loadedJson = makeTimeline(0, batchSize / 2, false);
+    const auto batchJson = makeTimeline(0, batchSize, true);
+
+    // Nothing listens on the port; the requests the room makes just fail
+    Connection c(QUrl("http://127.0.0.1:1"));
+    c.setCacheState(false);
+    c.connectWithToken("@bench:example.org", "token", "BENCHDEVICE");
+    qint64 totalNsecs = 0;
+    int runs = 0;
+    do {
+        BenchmarkRoom room(&c, roomId, JoinState::Join);
+        room.updateData({ roomId, JoinState::Join, loadedJson });
+        SyncRoomData batch(roomId, JoinState::Join, batchJson);
+        QElapsedTimer et;
+        et.start();
+        room.updateData(std::move(batch));
+        totalNsecs += et.nsecsElapsed();
+        ++runs;
+        QCOMPARE(room.timelineSize(), batchSize);
+    } while (totalNsecs < 200'000'000 && runs < 1000);
+    QTest::setBenchmarkResult(qreal(totalNsecs) / runs / 1'000'000,
+                              QTest::WalltimeMilliseconds);
+}
+
+void Benchmarks::applyMemberState_data()
+{
+    QTest::addColumn<int>("members");
+    for (auto members : { 1000, 10000 })
+        QTest::newRow(qPrintable(QStringLiteral("%1 members").arg(members)))
+            << members;
+}
+
+void Benchmarks::applyMemberState()
+{
+    // A room with lazy loading off: the whole member list comes as state
+    // and is keyed by the interned type and state key of each event.
+    // As in addEventsWithDuplicates(), only updateData() is timed.
+    QFETCH(int, members);
+    const auto roomId = QStringLiteral("!room:example.org");
+    QJsonArray state;
+    for (int i = 0; i < members; ++i)
+        state.append(makeMember(roomId, i));
+    const QJsonObject stateJson {
+        { "state", QJsonObject { { "events", state } } }
+    };
+
+    Connection c(QUrl("http://127.0.0.1:1"));
+    c.setCacheState(false);
+    c.connectWithToken("@bench:example.org", "token", "BENCHDEVICE");
+    qint64 totalNsecs = 0;
+    int runs = 0;
+    do {
+        BenchmarkRoom room(&c, roomId, JoinState::Join);
+        SyncRoomData batch(roomId, JoinState::Join, stateJson);
+        QElapsedTimer et;
+        et.start();
+        room.updateData(std::move(batch));
+        totalNsecs += et.nsecsElapsed();
+        ++runs;
+        QCOMPARE(room.joinedCount(), members);
+    } while (totalNsecs < 200'000'000 && runs < 1000);
+    QTest::setBenchmarkResult(qreal(totalNsecs) / runs / 1'000'000,
+                              QTest::WalltimeMilliseconds);
+}
+
+void Benchmarks::loadEventMix()
+{
+    // Roughly what a timeline of an active room consists of, with
+    // a few types that are not known to the library
+    static const std::pair<const char*, int> typeMix[] = {
+        { "m.room.message", 60 },      { "m.reaction", 10 },
+        { "m.room.member", 10 },       { "m.room.redaction", 5 },
+        { "m.room.encrypted", 5 },     { "m.room.name", 2 },
+        { "m.room.topic", 2 },         { "m.room.power_levels", 1 },
+        { "m.call.invite", 1 },        { "m.sticker", 2 },
+        { "org.example.custom", 2 },
+    };
+    const auto roomId = QStringLiteral("!room:example.org");
+    std::vector<QJsonObject> events;
+    for (const auto& [type, share] : typeMix)
+        for (int i = 0; i < share * 10; ++i) {
+            auto json = makeMessage(roomId, int(events.size()));
+            json.insert("type", type);
+            if (QByteArray(type).startsWith("m.room.")
+                && qstrcmp(type, "m.room.message") != 0
+                && qstrcmp(type, "m.room.redaction") != 0
+                && qstrcmp(type, "m.room.encrypted") != 0)
+                json.insert("state_key", "");
+            events.push_back(json);
+        }
+    // Interleave the types as they would be in a timeline
+    std::shuffle(events.begin(), events.end(), std::mt19937 {});
+
+    QBENCHMARK {
+        for (const auto& json : events)
+            QVERIFY(loadEvent<RoomEvent>(json) != nullptr);
+    }
+}
+
+QTEST_GUILESS_MAIN(Benchmarks)
+#include "benchmarks.moc"
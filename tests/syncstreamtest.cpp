@@ -0,0 +1,158 @@
+#include "syncdata.h"
+
+#include "events/roommessageevent.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+namespace {
+/// A /sync response exercising the parts of JSON the stream parser scans
+const QByteArray Response = R"({
+    "next_batch": "s72595_4483_1934",
+    "account_data": { "events": [] },
+    "rooms": {
+        "join": {
+            "!abc:example.org": {
+                "timeline": {
+                    "limited": true,
+                    "prev_batch": "t34-23535_0_0",
+                    "events": [ {
+                        "type": "m.room.message",
+                        "event_id": "$1:example.org",
+                        "sender": "@alice:example.org",
+                        "origin_server_ts": 1432735824653,
+                        "content": {
+                            "msgtype": "m.text",
+                            "body": "}{ ][ \"quoted\" \\ é ☺"
+                        }
+                    } ]
+                },
+                "unread_notifications": { "highlight_count": 1,
+                                          "notification_count": 2 }
+            },
+            "!oth\u0065r:example.org": { "timeline": { "events": [] } }
+        },
+        "leave": {
+            "!left:example.org": { "timeline": { "events": [] } }
+        }
+    }
+})";
+
+const auto MessageBody = QStringLiteral("}{ ][ \"quoted\" \\ é ☺");
+} // namespace
+
+class SyncStreamTest : public QObject {
+    Q_OBJECT
+private:
+    static void checkResponse(SyncData&& data)
+    {
+        QCOMPARE(data.nextBatch(), QStringLiteral("s72595_4483_1934"));
+        const auto rooms = data.takeRoomData();
+        QCOMPARE(int(rooms.size()), 3);
+        // The order of the response is kept
+        QCOMPARE(rooms[0].roomId, QStringLiteral("!abc:example.org"));
+        QCOMPARE(rooms[0].joinState, JoinState::Join);
+        QVERIFY(rooms[0].timelineLimited);
+        QCOMPARE(rooms[0].timelinePrevBatch, QStringLiteral("t34-23535_0_0"));
+        QCOMPARE(rooms[0].highlightCount, 1);
+        QCOMPARE(rooms[0].notificationCount, 2);
+        QCOMPARE(int(rooms[0].timeline.size()), 1);
+        const auto* message =
+            eventCast<const RoomMessageEvent>(rooms[0].timeline.front());
+        QVERIFY(message);
+        QCOMPARE(message->plainBody(), MessageBody);
+        QCOMPARE(rooms[1].roomId, QStringLiteral("!other:example.org"));
+        QCOMPARE(rooms[2].roomId, QStringLiteral("!left:example.org"));
+        QCOMPARE(rooms[2].joinState, JoinState::Leave);
+    }
+
+    static QString parseError(const QByteArray& json)
+    {
+        SyncStreamParser parser;
+        if (parser.feed(json) && parser.finish())
+            return {};
+        return parser.errorString();
+    }
+
+private slots:
+    void wholeResponse()
+    {
+        SyncStreamParser parser;
+        QVERIFY(parser.feed(Response));
+        QVERIFY(parser.finish());
+        checkResponse(parser.takeData());
+    }
+
+    void splitAnywhere_data()
+    {
+        QTest::addColumn<int>("chunkSize");
+        for (const auto size : { 1, 2, 3, 7, 64 })
+            QTest::addRow("%d", size) << size;
+    }
+    void splitAnywhere()
+    {
+        // Every string, escape sequence and literal ends up split between
+        // chunks with one of these sizes
+        QFETCH(int, chunkSize);
+        SyncStreamParser parser;
+        for (int i = 0; i < Response.size(); i += chunkSize)
+            QVERIFY(parser.feed(Response.mid(i, chunkSize)));
+        QVERIFY(parser.finish());
+        checkResponse(parser.takeData());
+    }
+
+    void truncated_data()
+    {
+        QTest::addColumn<int>("length");
+        QTest::addRow("empty") << 0;
+        QTest::addRow("in a key") << Response.indexOf("next_batch") + 4;
+        QTest::addRow("in an escape") << Response.indexOf("\\u0065") + 2;
+        QTest::addRow("in a room") << Response.indexOf("\"quoted") + 3;
+        QTest::addRow("in a literal") << Response.indexOf("true") + 2;
+        QTest::addRow("last brace") << Response.size() - 1;
+    }
+    void truncated()
+    {
+        QFETCH(int, length);
+        SyncStreamParser parser;
+        QVERIFY(parser.feed(Response.left(length)));
+        QVERIFY(!parser.finish());
+        QVERIFY(!parser.errorString().isEmpty());
+    }
+
+    void invalid_data()
+    {
+        QTest::addColumn<QByteArray>("json");
+        QTest::addRow("not an object") << QByteArray(R"(["rooms"])");
+        QTest::addRow("unbalanced") << QByteArray(R"({"rooms": {]})");
+        QTest::addRow("extra brace") << QByteArray(R"({"next_batch": "x"}})");
+        QTest::addRow("unexpected character")
+            << QByteArray(R"({"next_batch": @})");
+        QTest::addRow("colon in an array")
+            << QByteArray(R"({"account_data": [1: 2]})");
+        QTest::addRow("trailing data")
+            << QByteArray(R"({"next_batch": "x"} {})");
+        QTest::addRow("bad top-level value")
+            << QByteArray(R"({"next_batch": tru})");
+        QTest::addRow("bad room")
+            << QByteArray(R"({"rooms": {"join": {"!r:example.org": )"
+                          R"({"timeline": {"limited": nul}}}}})");
+    }
+    void invalid()
+    {
+        QFETCH(QByteArray, json);
+        QVERIFY(!parseError(json).isEmpty());
+    }
+
+    void failureSticks()
+    {
+        SyncStreamParser parser;
+        QVERIFY(!parser.feed("[]"));
+        QVERIFY(!parser.feed("{}"));
+        QVERIFY(!parser.finish());
+    }
+};
+
+QTEST_GUILESS_MAIN(SyncStreamTest)
+#include "syncstreamtest.moc"
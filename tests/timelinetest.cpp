@@ -0,0 +1,835 @@
+#include "connection.h"
+#include "room.h"
+
+#include "events/reactionevent.h"
+#include "events/redactionevent.h"
+#include "events/roommessageevent.h"
+
+#include <QtCore/QStandardPaths>
+#include <QtCore/QUrlQuery>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+#include <QtTest/QSignalSpy>
+#include <QtTest/QtTest>
+
+#include <functional>
+
+using namespace Quotient;
+
+/// Synthetic sync data for a single room
+namespace {
+const auto RoomId = QStringLiteral("!timeline:example.org");
+const auto LocalUserId = QStringLiteral("@local:example.org");
+
+QString eventId(int n) { return QStringLiteral("$e%1:example.org").arg(n); }
+
+QJsonObject makeMessage(int n)
+{
+    return { { "type", "m.room.message" },
+             { "event_id", eventId(n) },
+             { "sender", QStringLiteral("@user%1:example.org").arg(n % 3) },
+             { "origin_server_ts", 1500000000000 + n },
+             { "content", QJsonObject { { "msgtype", "m.text" },
+                                        { "body", QStringLiteral("Message %1")
+                                                      .arg(n) } } } };
+}
+
+QJsonObject makeReaction(int n, int targetN)
+{
+    auto json = makeMessage(n);
+    json.insert("type", "m.reaction");
+    json.insert("content",
+                QJsonObject { { "m.relates_to",
+                                QJsonObject { { "rel_type", "m.annotation" },
+                                              { "event_id", eventId(targetN) },
+                                              { "key", "+1" } } } });
+    return json;
+}
+
+/// Messages \p from to \p to, not including \p to, in the sync format
+QJsonArray makeMessages(int from, int to)
+{
+    QJsonArray events;
+    for (int n = from; n < to; ++n)
+        events.append(makeMessage(n));
+    return events;
+}
+
+QJsonObject makeTimeline(const QJsonArray& events, const QString& prevBatch,
+                         bool limited = false)
+{
+    return { { "timeline", QJsonObject { { "events", events },
+                                         { "prev_batch", prevBatch },
+                                         { "limited", limited } } } };
+}
+
+QJsonObject makeRedaction(int n, int redactedN)
+{
+    auto json = makeMessage(n);
+    json.insert("type", "m.room.redaction");
+    json.insert("redacts", eventId(redactedN));
+    json.insert("content", QJsonObject());
+    return json;
+}
+
+QJsonObject makeEdit(int n, int editedN)
+{
+    auto json = makeMessage(n);
+    const auto newBody = QStringLiteral("Edited %1").arg(editedN);
+    json.insert("content",
+                QJsonObject {
+                    { "msgtype", "m.text" },
+                    { "body", "* " + newBody },
+                    { "m.new_content",
+                      QJsonObject { { "msgtype", "m.text" },
+                                    { "body", newBody } } },
+                    { "m.relates_to",
+                      QJsonObject { { "rel_type", "m.replace" },
+                                    { "event_id", eventId(editedN) } } } });
+    return json;
+}
+
+QJsonObject makeFullyRead(int n)
+{
+    const QJsonObject marker {
+        { "type", "m.fully_read" },
+        { "content", QJsonObject { { "event_id", eventId(n) } } }
+    };
+    return { { "account_data",
+               QJsonObject { { "events", QJsonArray { marker } } } } };
+}
+
+QString readerId(int n) { return QStringLiteral("@reader%1:example.org").arg(n); }
+
+/// Joined members that read the messages and never send any
+QJsonObject makeReaders(int count)
+{
+    QJsonArray members;
+    for (int n = 0; n < count; ++n)
+        members.append(QJsonObject {
+            { "type", "m.room.member" },
+            { "event_id", QStringLiteral("$m%1:example.org").arg(n) },
+            { "sender", readerId(n) },
+            { "state_key", readerId(n) },
+            { "origin_server_ts", 1400000000000 + n },
+            { "content", QJsonObject { { "membership", "join" } } } });
+    return { { "state", QJsonObject { { "events", members } } } };
+}
+
+/// A receipt batch, from (event number, reader number) pairs
+/** The pairs are sorted by the JSON object, as they come from the server. */
+QJsonObject makeReceipts(const std::vector<std::pair<int, int>>& receipts)
+{
+    QJsonObject content;
+    for (const auto& [n, readerN] : receipts) {
+        auto eventReceipts = content.value(eventId(n)).toObject();
+        auto readReceipts = eventReceipts.value("m.read").toObject();
+        readReceipts.insert(readerId(readerN),
+                            QJsonObject { { "ts", 1500000000000 + n } });
+        eventReceipts.insert("m.read", readReceipts);
+        content.insert(eventId(n), eventReceipts);
+    }
+    const QJsonObject receiptEvent { { "type", "m.receipt" },
+                                     { "content", content } };
+    return { { "ephemeral",
+               QJsonObject { { "events", QJsonArray { receiptEvent } } } } };
+}
+} // namespace
+
+/// A homeserver that answers each request with what the handler returns
+/** An empty object from the handler makes a 404 response. */
+class FakeServer : public QTcpServer {
+public:
+    using handler_t =
+        std::function<QJsonObject(const QString& path, const QUrlQuery& query)>;
+    handler_t handler;
+
+    FakeServer()
+    {
+        listen(QHostAddress::LocalHost);
+        connect(this, &QTcpServer::newConnection, this, [this] {
+            while (auto* socket = nextPendingConnection()) {
+                connect(socket, &QTcpSocket::readyRead, socket,
+                        [this, socket] { respond(socket); });
+                connect(socket, &QTcpSocket::disconnected, socket,
+                        &QObject::deleteLater);
+            }
+        });
+    }
+
+    QUrl url() const
+    {
+        return QUrl(QStringLiteral("http://127.0.0.1:%1").arg(serverPort()));
+    }
+
+private:
+    void respond(QTcpSocket* socket)
+    {
+        auto request = socket->property("request").toByteArray();
+        request += socket->readAll();
+        socket->setProperty("request", request);
+        const auto headersEnd = request.indexOf("\r\n\r\n");
+        if (headersEnd == -1)
+            return;
+        int bodySize = 0;
+        for (const auto& header : request.left(headersEnd).split('\n'))
+            if (header.toLower().startsWith("content-length:"))
+                bodySize = header.mid(15).trimmed().toInt();
+        if (request.size() < headersEnd + 4 + bodySize)
+            return;
+
+        const QUrl url { QString::fromLatin1(request.split(' ').value(1)) };
+        auto json = handler ? handler(url.path(QUrl::FullyDecoded),
+                                      QUrlQuery(url))
+                            : QJsonObject();
+        const auto found = !json.isEmpty();
+        if (!found)
+            json = { { "errcode", "M_NOT_FOUND" } };
+        const auto body = QJsonDocument(json).toJson(QJsonDocument::Compact);
+        socket->write(QByteArray(found ? "HTTP/1.1 200 OK\r\n"
+                                       : "HTTP/1.1 404 Not Found\r\n")
+                      + "Content-Type: application/json\r\n"
+                      + "Content-Length: " + QByteArray::number(body.size())
+                      + "\r\nConnection: close\r\n\r\n" + body);
+        socket->disconnectFromHost();
+    }
+};
+
+/// Gives access to Room::updateData() for feeding sync data directly
+class TestRoom : public Room {
+public:
+    using Room::Room;
+    using Room::updateData;
+
+    void sync(const QJsonObject& json)
+    {
+        updateData({ id(), JoinState::Join, json });
+    }
+};
+
+class TimelineTest : public QObject {
+    Q_OBJECT
+private slots:
+    void initTestCase();
+    void init();
+    void cleanup();
+    void evictionPastReadMarker();
+    void evictionCleansUp();
+    void restartAfterLimitedSync();
+    void gapInsertion();
+    void gapInsertionNearNewest();
+    void fragmentMergesForward();
+    void fragmentMergesBack();
+    void fragmentStaysDetached();
+    void fragmentMergeKeepsMarkers();
+    void echoMatching();
+    void editsAndRedactionsInBatch();
+    void unreadCountWithRedactionsAndEviction();
+    void readReceipts();
+
+private:
+    FakeServer server;
+    Connection* c = nullptr;
+    TestRoom* room = nullptr;
+
+    /// Make a new connection and room with the timeline store of the old ones
+    void restart();
+};
+
+void TimelineTest::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+void TimelineTest::init()
+{
+    server.handler = nullptr;
+    c = new Connection(server.url());
+    c->connectWithToken(LocalUserId, "token", "TESTDEVICE");
+    // Start with no timeline store left from previous tests
+    c->stateCacheDir().removeRecursively();
+    c->setCacheState(false);
+    room = new TestRoom(c, RoomId, JoinState::Join);
+}
+
+void TimelineTest::cleanup()
+{
+    // The room is a child of the connection, which saves it on the way out
+    delete c;
+}
+
+void TimelineTest::restart()
+{
+    delete c;
+    c = new Connection(server.url());
+    c->connectWithToken(LocalUserId, "token", "TESTDEVICE");
+    c->setCacheState(true);
+    c->setCacheTimeline(true);
+    room = new TestRoom(c, RoomId, JoinState::Join);
+}
+
+void TimelineTest::evictionCleansUp()
+{
+    // With the timeline store, the events can be evicted up to any event
+    // and are reloaded from the store
+    c->setCacheState(true);
+    c->setCacheTimeline(true);
+    room->sync(makeTimeline(makeMessages(0, 10), "t0"));
+    auto events = makeMessages(10, 20);
+    events[5] = makeReaction(15, 4);
+    room->sync(makeTimeline(events, "t10"));
+    QCOMPARE(room->relatedEvents(eventId(4), EventRelation::Annotation()).size(),
+             1);
+    room->setFirstDisplayedEventId(eventId(2));
+    room->setLastDisplayedEventId(eventId(6));
+    room->sync(makeFullyRead(12));
+
+    room->setTimelineLimit(10);
+    QCOMPARE(room->minTimelineIndex(), 10);
+    QVERIFY(room->findInTimeline(eventId(4)) == room->timelineEdge());
+    QVERIFY(room->relatedEvents(eventId(4), EventRelation::Annotation())
+                .isEmpty());
+    QVERIFY(room->firstDisplayedEventId().isEmpty());
+    QVERIFY(room->lastDisplayedEventId().isEmpty());
+
+    // Reloading the events links them to the reactions again
+    room->setTimelineLimit(0);
+    room->getPreviousContent(10);
+    QCOMPARE(room->minTimelineIndex(), 0);
+    QCOMPARE(room->relatedEvents(eventId(4), EventRelation::Annotation()).size(),
+             1);
+}
+
+void TimelineTest::restartAfterLimitedSync()
+{
+    c->setCacheState(true);
+    c->setCacheTimeline(true);
+    room->sync(makeTimeline(makeMessages(0, 5), "t0"));
+    restart();
+
+    // After a restart, the timeline is empty until events are loaded from
+    // the store; the gap is recorded in the store nevertheless
+    room->sync(makeTimeline(makeMessages(20, 25), "t20", true));
+    QCOMPARE(room->timelineSize(), 5);
+    room->getPreviousContent(10);
+    QCOMPARE(room->timelineSize(), 10);
+    QVERIFY(room->hasGapBefore(eventId(20)));
+    QVERIFY(!room->hasGapBefore(eventId(4)));
+
+    // The gap survives another restart, and the events that fill it are
+    // stored in their place
+    restart();
+    c->setTimelineInsertion(true);
+    c->setGapFilling(true);
+    server.handler = [](const QString& path, const QUrlQuery& query) {
+        if (!path.endsWith("/messages")
+            || query.queryItemValue("from") != "t20")
+            return QJsonObject();
+        QJsonArray chunk;
+        for (int n = 19; n >= 4; --n)
+            chunk.append(makeMessage(n));
+        return QJsonObject { { "chunk", chunk },
+                             { "start", "t20" },
+                             { "end", "t4" } };
+    };
+    QSignalSpy inserted(room, &Room::insertedMessages);
+    room->setDisplayed();
+    QCOMPARE(room->timelineSize(), 10);
+    QVERIFY(room->hasGapBefore(eventId(20)));
+    QVERIFY(inserted.wait());
+    QCOMPARE(room->timelineSize(), 25);
+    QVERIFY(!room->hasGapBefore(eventId(20)));
+
+    restart();
+    room->getPreviousContent(30);
+    QCOMPARE(room->timelineSize(), 25);
+    for (int n = 0; n < 25; ++n) {
+        QCOMPARE(room->findInTimeline(eventId(n))->index(), n - 25);
+        QVERIFY(!room->hasGapBefore(eventId(n)));
+    }
+}
+
+void TimelineTest::gapInsertion()
+{
+    c->setTimelineInsertion(true);
+    c->setGapFilling(true);
+    room->setDisplayed();
+    room->sync(makeTimeline(makeMessages(0, 5), "t0"));
+    room->sync(makeFullyRead(2));
+    QCOMPARE(room->unreadCount(), 2);
+    QHash<int, const RoomEvent*> events;
+    for (int n = 0; n < 5; ++n)
+        events.insert(n, room->findInTimeline(eventId(n))->event());
+
+    // The server returns the events in the gap along with one before it
+    server.handler = [](const QString& path, const QUrlQuery& query) {
+        if (!path.endsWith("/messages")
+            || query.queryItemValue("from") != "t10")
+            return QJsonObject();
+        QJsonArray chunk;
+        for (int n = 9; n >= 4; --n)
+            chunk.append(makeMessage(n));
+        return QJsonObject { { "chunk", chunk },
+                             { "start", "t10" },
+                             { "end", "t4" } };
+    };
+    std::vector<int> insertionPoints;
+    connect(room, &Room::aboutToInsertMessages, this,
+            [&insertionPoints](RoomEventsRange events, int beforeIndex) {
+                QCOMPARE(int(events.size()), 5);
+                insertionPoints.push_back(beforeIndex);
+            });
+    QSignalSpy inserted(room, &Room::insertedMessages);
+    QSignalSpy evicted(room, &Room::evictedMessages);
+    QSignalSpy added(room, &Room::addedMessages);
+    room->sync(makeTimeline(makeMessages(10, 15), "t10", true));
+    QCOMPARE(added.count(), 1);
+    QCOMPARE(room->unreadCount(), 7);
+    QVERIFY(inserted.wait());
+
+    QCOMPARE(insertionPoints, std::vector<int> { 5 });
+    QCOMPARE(inserted.front().at(0).toInt(), 0);
+    QCOMPARE(inserted.front().at(1).toInt(), 4);
+    QCOMPARE(evicted.count(), 0);
+    QCOMPARE(added.count(), 1);
+    // With as many events on either side of the gap, the older ones move down
+    QCOMPARE(room->timelineSize(), 15);
+    for (int n = 0; n < 15; ++n) {
+        const auto it = room->findInTimeline(eventId(n));
+        QVERIFY(it != room->timelineEdge());
+        QCOMPARE(it->index(), n - 5);
+        QCOMPARE(room->findInTimeline(n - 5)->event()->id(), eventId(n));
+    }
+    // The events that were in the timeline are not recreated
+    for (auto it = events.cbegin(); it != events.cend(); ++it)
+        QCOMPARE(room->findInTimeline(eventId(it.key()))->event(), it.value());
+    QCOMPARE(room->readMarkerEventId(), eventId(2));
+    QCOMPARE(room->unreadCount(), 12);
+}
+
+void TimelineTest::gapInsertionNearNewest()
+{
+    c->setTimelineInsertion(true);
+    c->setGapFilling(true);
+    room->setDisplayed();
+    room->sync(makeTimeline(makeMessages(0, 10), "t0"));
+    server.handler = [](const QString& path, const QUrlQuery& query) {
+        if (!path.endsWith("/messages")
+            || query.queryItemValue("from") != "t20")
+            return QJsonObject();
+        QJsonArray chunk;
+        for (int n = 19; n >= 9; --n)
+            chunk.append(makeMessage(n));
+        return QJsonObject { { "chunk", chunk },
+                             { "start", "t20" },
+                             { "end", "t9" } };
+    };
+    QSignalSpy inserted(room, &Room::insertedMessages);
+    room->sync(makeTimeline(makeMessages(20, 22), "t20", true));
+    room->sync(makeFullyRead(20));
+    QCOMPARE(room->unreadCount(), 1);
+    QVERIFY(inserted.wait());
+
+    // There are fewer events after the gap than before it; so the newer
+    // events move up, and the older ones keep their indices
+    QCOMPARE(inserted.front().at(0).toInt(), 10);
+    QCOMPARE(inserted.front().at(1).toInt(), 19);
+    QCOMPARE(room->timelineSize(), 22);
+    for (int n = 0; n < 22; ++n) {
+        const auto it = room->findInTimeline(eventId(n));
+        QVERIFY(it != room->timelineEdge());
+        QCOMPARE(it->index(), n);
+    }
+    QCOMPARE(room->readMarker()->index(), 20);
+    QCOMPARE(room->unreadCount(), 1);
+}
+
+/// Make a timeline of events 0 to 4 and 20 to 24, with a gap in between
+static void makeTimelineWithGap(TestRoom* room)
+{
+    room->sync(makeTimeline(makeMessages(0, 5), "t0"));
+    room->sync(makeTimeline(makeMessages(20, 25), "t20", true));
+    QVERIFY(room->hasGapBefore(eventId(20)));
+}
+
+/// Answer /context for \p n with \p before events before it and \p after
+/// events after it, and /messages with \p messages for the given token
+static FakeServer::handler_t makeHistory(int n, int before, int after,
+                                         const QString& messagesToken,
+                                         const QVector<int>& messages)
+{
+    return [=](const QString& path, const QUrlQuery& query) {
+        if (path.endsWith("/context/" + eventId(n))) {
+            QJsonArray eventsBefore;
+            for (int i = n - 1; i >= n - before; --i)
+                eventsBefore.append(makeMessage(i));
+            return QJsonObject {
+                { "start", QStringLiteral("c%1").arg(n - before) },
+                { "end", QStringLiteral("c%1").arg(n + after + 1) },
+                { "events_before", eventsBefore },
+                { "event", makeMessage(n) },
+                { "events_after", makeMessages(n + 1, n + after + 1) }
+            };
+        }
+        if (path.endsWith("/messages")
+            && query.queryItemValue("from") == messagesToken) {
+            QJsonArray chunk;
+            for (auto i : messages)
+                chunk.append(makeMessage(i));
+            return QJsonObject { { "chunk", chunk },
+                                 { "start", messagesToken },
+                                 { "end", "x" } };
+        }
+        return QJsonObject();
+    };
+}
+
+void TimelineTest::fragmentMergesForward()
+{
+    c->setTimelineInsertion(true);
+    makeTimelineWithGap(room);
+    QVector<int> messages;
+    for (int n = 15; n <= 21; ++n)
+        messages.push_back(n);
+    server.handler = makeHistory(12, 2, 2, "c15", messages);
+    QSignalSpy contextLoaded(room, &Room::eventContextLoaded);
+    room->loadEventContext(eventId(12), 5);
+    QVERIFY(contextLoaded.wait());
+    QCOMPARE(int(room->fragmentEvents(eventId(12)).size()), 5);
+    QVERIFY(room->findInTimeline(eventId(12)) == room->timelineEdge());
+
+    // Reaching the event after the gap, the fragment fills the newer part
+    // of the gap
+    QSignalSpy merged(room, &Room::fragmentMerged);
+    room->getFragmentNextContent(eventId(12));
+    QVERIFY(merged.wait());
+    QCOMPARE(merged.front().front().toString(), eventId(12));
+    QVERIFY(room->fragmentEvents(eventId(12)).empty());
+    QVERIFY(room->fragmentEvents(eventId(15)).empty());
+    QCOMPARE(room->timelineSize(), 20);
+    for (int n = 20; n < 25; ++n)
+        QCOMPARE(room->findInTimeline(eventId(n))->index(), n - 15);
+    for (int n = 10; n < 20; ++n)
+        QCOMPARE(room->findInTimeline(eventId(n))->index(), n - 15);
+    for (int n = 0; n < 5; ++n)
+        QCOMPARE(room->findInTimeline(eventId(n))->index(), n - 10);
+    QVERIFY(!room->hasGapBefore(eventId(20)));
+    QVERIFY(room->hasGapBefore(eventId(10)));
+}
+
+void TimelineTest::fragmentMergesBack()
+{
+    c->setTimelineInsertion(true);
+    makeTimelineWithGap(room);
+    server.handler = makeHistory(7, 1, 1, "c6", { 5, 4, 3 });
+    QSignalSpy contextLoaded(room, &Room::eventContextLoaded);
+    room->loadEventContext(eventId(7), 3);
+    QVERIFY(contextLoaded.wait());
+    QCOMPARE(int(room->fragmentEvents(eventId(7)).size()), 3);
+
+    // Reaching the event before the gap, the fragment fills the older part
+    // of the gap
+    QSignalSpy merged(room, &Room::fragmentMerged);
+    room->getFragmentPreviousContent(eventId(7));
+    QVERIFY(merged.wait());
+    QVERIFY(room->fragmentEvents(eventId(7)).empty());
+    QCOMPARE(room->timelineSize(), 14);
+    for (int n = 20; n < 25; ++n)
+        QCOMPARE(room->findInTimeline(eventId(n))->index(), n - 15);
+    for (int n = 0; n < 9; ++n)
+        QCOMPARE(room->findInTimeline(eventId(n))->index(), n - 4);
+    QVERIFY(room->hasGapBefore(eventId(20)));
+    QVERIFY(!room->hasGapBefore(eventId(5)));
+}
+
+void TimelineTest::fragmentStaysDetached()
+{
+    makeTimelineWithGap(room);
+    QVector<int> messages;
+    for (int n = 15; n <= 21; ++n)
+        messages.push_back(n);
+    server.handler = makeHistory(12, 2, 2, "c15", messages);
+    QSignalSpy contextLoaded(room, &Room::eventContextLoaded);
+    room->loadEventContext(eventId(12), 5);
+    QVERIFY(contextLoaded.wait());
+
+    // Without timeline insertion, the fragment reaching the event after
+    // the gap doesn't change the indices of the timeline events
+    QSignalSpy changed(room, &Room::fragmentChanged);
+    QSignalSpy merged(room, &Room::fragmentMerged);
+    QSignalSpy inserted(room, &Room::insertedMessages);
+    room->getFragmentNextContent(eventId(12));
+    QVERIFY(changed.wait());
+    QCOMPARE(merged.count(), 0);
+    QCOMPARE(inserted.count(), 0);
+    QCOMPARE(int(room->fragmentEvents(eventId(12)).size()), 10);
+    QCOMPARE(room->timelineSize(), 10);
+    for (int n = 0; n < 5; ++n)
+        QCOMPARE(room->findInTimeline(eventId(n))->index(), n);
+    for (int n = 20; n < 25; ++n)
+        QCOMPARE(room->findInTimeline(eventId(n))->index(), n - 15);
+    QVERIFY(room->hasGapBefore(eventId(20)));
+}
+
+void TimelineTest::fragmentMergeKeepsMarkers()
+{
+    c->setTimelineInsertion(true);
+    makeTimelineWithGap(room);
+    room->sync(makeFullyRead(3));
+    QCOMPARE(room->unreadCount(), 6);
+    room->setLastDisplayedEventId(eventId(21));
+
+    // A model of the timeline, the way clients keep one: a row per event
+    // from the oldest to the newest, following the signals of the room
+    QStringList model;
+    for (const auto& ti : room->messageEvents())
+        model << ti->id();
+    connect(room, &Room::insertedMessages, this,
+            [this, &model](int from, int to) {
+                for (auto index = from; index <= to; ++index)
+                    model.insert(index - room->minTimelineIndex(),
+                                 room->findInTimeline(index)->event()->id());
+            });
+
+    QVector<int> messages;
+    for (int n = 15; n <= 21; ++n)
+        messages.push_back(n);
+    server.handler = makeHistory(12, 2, 2, "c15", messages);
+    QSignalSpy contextLoaded(room, &Room::eventContextLoaded);
+    room->loadEventContext(eventId(12), 5);
+    QVERIFY(contextLoaded.wait());
+    QSignalSpy merged(room, &Room::fragmentMerged);
+    room->getFragmentNextContent(eventId(12));
+    QVERIFY(merged.wait());
+
+    QCOMPARE(room->timelineSize(), 20);
+    QCOMPARE(model.size(), 20);
+    for (int row = 0; row < model.size(); ++row) {
+        const auto it = room->findInTimeline(room->minTimelineIndex() + row);
+        QCOMPARE(it->event()->id(), model[row]);
+    }
+    // The markers point to the same events, at their current indices
+    QCOMPARE(room->readMarkerEventId(), eventId(3));
+    QCOMPARE(room->readMarker()->index(),
+             room->findInTimeline(eventId(3))->index());
+    QCOMPARE(room->lastDisplayedMarker()->event()->id(), eventId(21));
+    // The merged events come after the read marker and are unread now
+    QCOMPARE(room->unreadCount(), 16);
+}
+
+void TimelineTest::echoMatching()
+{
+    room->sync(makeTimeline(makeMessages(0, 5), "t0"));
+    QStringList txnIds;
+    for (int i = 0; i < 5; ++i)
+        txnIds << room->postPlainText(QStringLiteral("Pending %1").arg(i));
+    QCOMPARE(int(room->pendingEvents().size()), 5);
+
+    // The echoes come out of order, along with other events
+    const auto makeEcho = [&txnIds](int n, int pendingIdx) {
+        auto json = makeMessage(n);
+        json.insert("sender", LocalUserId);
+        json.insert("unsigned", QJsonObject { { "transaction_id",
+                                                txnIds[pendingIdx] } });
+        return json;
+    };
+    QJsonArray events { makeMessage(5), makeEcho(6, 3), makeMessage(7),
+                        makeEcho(8, 1), makeEcho(9, 4) };
+    // The indices are as of the moment of merging each echo
+    std::vector<int> mergedIndices;
+    connect(room, &Room::pendingEventAboutToMerge, this,
+            [&mergedIndices](RoomEvent*, int pendingIdx) {
+                mergedIndices.push_back(pendingIdx);
+            });
+    room->sync(makeTimeline(events, "t5"));
+    QCOMPARE(mergedIndices, (std::vector<int> { 3, 1, 2 }));
+
+    QCOMPARE(room->timelineSize(), 10);
+    for (int n = 0; n < 10; ++n)
+        QCOMPARE(room->findInTimeline(n)->event()->id(), eventId(n));
+    const auto& pending = room->pendingEvents();
+    QCOMPARE(int(pending.size()), 2);
+    QCOMPARE(pending[0]->transactionId(), txnIds[0]);
+    QCOMPARE(pending[1]->transactionId(), txnIds[2]);
+    for (int i = 0; i < 5; ++i) {
+        const auto it = room->findPendingEvent(txnIds[i]);
+        if (i == 0 || i == 2)
+            QCOMPARE((*it)->transactionId(), txnIds[i]);
+        else
+            QVERIFY(it == pending.end());
+    }
+}
+
+void TimelineTest::editsAndRedactionsInBatch()
+{
+    // Event 1 is edited by an event after it, event 4 by an event before
+    // it; event 6 is redacted by an event before it
+    room->sync(makeTimeline({ makeMessage(0), makeMessage(1), makeEdit(2, 1),
+                              makeEdit(3, 4), makeMessage(4),
+                              makeRedaction(5, 6), makeMessage(6) },
+                            "t0"));
+    QCOMPARE(room->timelineSize(), 7);
+    const std::pair<int, int> edits[] = { { 1, 2 }, { 4, 3 } };
+    for (const auto& [editedN, editN] : edits) {
+        const auto it = room->findInTimeline(eventId(editedN));
+        QVERIFY(it != room->timelineEdge());
+        QCOMPARE(it->event()->replacedBy(), eventId(editN));
+        const auto* msg = eventCast<const RoomMessageEvent>(it->event());
+        QVERIFY(msg != nullptr);
+        QCOMPARE(msg->plainBody(), QStringLiteral("Edited %1").arg(editedN));
+    }
+    const auto redactedIt = room->findInTimeline(eventId(6));
+    QVERIFY(redactedIt->event()->isRedacted());
+    QCOMPARE(redactedIt->event()->redactedBecause()->id(), eventId(5));
+    QVERIFY(!room->findInTimeline(eventId(0))->event()->isRedacted());
+}
+
+void TimelineTest::unreadCountWithRedactionsAndEviction()
+{
+    // Events 10 to 19 come with the sync and have non-negative indices,
+    // events 0 to 9 come from history and have negative indices
+    room->sync(makeTimeline(makeMessages(10, 20), "t10"));
+    server.handler = makeHistory(0, 0, 0, "t10",
+                                 { 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 });
+    QSignalSpy added(room, &Room::addedMessages);
+    room->getPreviousContent(10);
+    QVERIFY(added.wait());
+    QCOMPARE(room->minTimelineIndex(), -10);
+    room->sync(makeFullyRead(5));
+    QCOMPARE(room->unreadCount(), 14);
+
+    // Redacting unread messages on either side of index 0 leaves fewer
+    // unread messages; redacting read ones doesn't change the count
+    room->sync(makeTimeline({ makeRedaction(100, 12), makeRedaction(101, 3),
+                              makeRedaction(102, 7) },
+                            "t100"));
+    QCOMPARE(room->unreadCount(), 12);
+    // Counting anew skips the redacted messages
+    room->sync(makeFullyRead(8));
+    QCOMPARE(room->unreadCount(), 10); // 9 to 19, except 12
+    room->sync(makeFullyRead(16));
+    QCOMPARE(room->unreadCount(), 3);
+
+    // Evicting the read events doesn't affect the unread ones
+    room->setTimelineLimit(5);
+    QCOMPARE(room->minTimelineIndex(), 0);
+    QCOMPARE(room->unreadCount(), 3);
+    room->sync(makeFullyRead(18));
+    QCOMPARE(room->unreadCount(), 1);
+    room->sync(makeTimeline(makeMessages(20, 22), "t20"));
+    QCOMPARE(room->unreadCount(), 3);
+}
+
+void TimelineTest::evictionPastReadMarker()
+{
+    for (int batch = 0; batch < 4; ++batch)
+        room->sync(makeTimeline(makeMessages(batch * 5, batch * 5 + 5),
+                                QStringLiteral("t%1").arg(batch * 5)));
+    room->sync(makeFullyRead(7));
+    QCOMPARE(room->readMarkerEventId(), eventId(7));
+    QCOMPARE(room->unreadCount(), 12);
+
+    // Eviction goes past the read marker; the marker and the unread count
+    // stay, even though the marker is not in the timeline any more
+    QSignalSpy evicted(room, &Room::evictedMessages);
+    room->setTimelineLimit(10);
+    QCOMPARE(evicted.count(), 1);
+    QCOMPARE(room->minTimelineIndex(), 10);
+    QVERIFY(room->readMarker() == room->timelineEdge());
+    QCOMPARE(room->readMarkerEventId(), eventId(7));
+    QCOMPARE(room->unreadCount(), 12);
+
+    // Unread messages are still counted, both ways
+    room->sync(makeTimeline({ makeRedaction(100, 12) }, "t100"));
+    QCOMPARE(room->unreadCount(), 11);
+    room->sync(makeTimeline(makeMessages(20, 22), "t20"));
+    QCOMPARE(room->unreadCount(), 13);
+
+    // The events between the marker and the timeline have been counted
+    // already; the count is checked again when the marker is reloaded
+    room->setTimelineLimit(0);
+    server.handler = [](const QString& path, const QUrlQuery& query) {
+        if (!path.endsWith("/messages"))
+            return QJsonObject();
+        const auto from = query.queryItemValue("from");
+        const auto chunk = from == "t10" ? QVector<int> { 9, 8 }
+                           : from == "t8" ? QVector<int> { 7, 6, 5 }
+                                          : QVector<int>();
+        if (chunk.isEmpty())
+            return QJsonObject();
+        QJsonArray events;
+        for (auto n : chunk)
+            events.append(makeMessage(n));
+        return QJsonObject { { "chunk", events },
+                             { "start", from },
+                             { "end", from == "t10" ? "t8" : "t5" } };
+    };
+    QSignalSpy added(room, &Room::addedMessages);
+    room->getPreviousContent(2);
+    QVERIFY(added.wait());
+    QCOMPARE(room->minTimelineIndex(), 8);
+    QVERIFY(room->readMarker() == room->timelineEdge());
+    QCOMPARE(room->unreadCount(), 13);
+    room->getPreviousContent(3);
+    QVERIFY(added.wait());
+    QCOMPARE(room->minTimelineIndex(), 5);
+    QCOMPARE((*room->readMarker())->id(), eventId(7));
+    QCOMPARE(room->unreadCount(), 13); // 8 to 21, except 12
+
+    room->sync(makeFullyRead(17));
+    QCOMPARE(room->unreadCount(), 4);
+}
+
+void TimelineTest::readReceipts()
+{
+    room->sync(makeReaders(4));
+    room->sync(makeTimeline(makeMessages(0, 10), "t0"));
+    const auto readers = [this](int n) {
+        QStringList ids;
+        for (const auto* u : room->usersAtEventId(eventId(n)))
+            ids << u->id();
+        return ids;
+    };
+    const auto readMarkerOf = [this](int readerN) {
+        const auto marker = room->readMarker(room->user(readerId(readerN)));
+        return marker == room->timelineEdge() ? QString() : (*marker)->id();
+    };
+
+    // In a batch, only the newest receipt of each user counts; the users
+    // come in the order of their first receipts in the batch, and the batch
+    // goes from $e2 to $e5
+    QSignalSpy moved(room, &Room::readMarkerForUserMoved);
+    room->sync(makeReceipts({ { 3, 0 }, { 3, 1 }, { 5, 2 }, { 2, 1 } }));
+    QCOMPARE(moved.count(), 3);
+    QCOMPARE(readers(3), QStringList({ readerId(1), readerId(0) }));
+    QCOMPARE(readers(5), QStringList({ readerId(2) }));
+    QVERIFY(readers(2).isEmpty());
+    QCOMPARE(readMarkerOf(1), eventId(3));
+
+    // Receipts move forward, never back; the users that moved leave
+    // the previous event and come after those already at the new one
+    room->sync(makeReceipts({ { 7, 1 } }));
+    room->sync(makeReceipts({ { 7, 0 }, { 4, 2 } }));
+    QCOMPARE(moved.count(), 5);
+    QVERIFY(readers(3).isEmpty());
+    QCOMPARE(readers(7), QStringList({ readerId(1), readerId(0) }));
+    QCOMPARE(readers(5), QStringList({ readerId(2) }));
+    QCOMPARE(readMarkerOf(2), eventId(5));
+
+    // A receipt at an event that is not loaded yet is kept for a user
+    // without a marker and gets indexed once the event arrives
+    room->sync(makeReceipts({ { 12, 3 }, { 12, 2 } }));
+    QCOMPARE(readers(12), QStringList({ readerId(3) }));
+    QVERIFY(readMarkerOf(3).isEmpty());
+    room->sync(makeTimeline(makeMessages(10, 15), "t10"));
+    QCOMPARE(readMarkerOf(3), eventId(12));
+    QCOMPARE(readers(12), QStringList({ readerId(3) }));
+    room->sync(makeReceipts({ { 13, 3 } }));
+    room->sync(makeReceipts({ { 13, 2 } }));
+    QCOMPARE(readers(13), QStringList({ readerId(3), readerId(2) }));
+    QVERIFY(readers(12).isEmpty());
+    QVERIFY(readers(5).isEmpty());
+}
+
+QTEST_GUILESS_MAIN(TimelineTest)
+#include "timelinetest.moc"